@@ -0,0 +1,39 @@
+#ifndef _ASYNC_VERSION_H
+#define _ASYNC_VERSION_H
+
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/sched/mm.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#include <linux/mmu_context.h>
+#else
+#include <linux/kthread.h>
+#endif
+
+/*
+ * ki_complete lost its second result in 5.16.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#define ki_complete_wrapper(iocb, res)	((iocb)->ki_complete((iocb), (res), 0))
+#else
+#define ki_complete_wrapper(iocb, res)	((iocb)->ki_complete((iocb), (res)))
+#endif
+
+/*
+ * Borrowing the address space of a process from a kernel thread.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#define kthread_use_mm		use_mm
+#define kthread_unuse_mm	unuse_mm
+#endif
+
+/*
+ * Single user buffers got an iterator type of their own in 6.0.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#define iter_is_ubuf(i)		0
+#define user_backed_iter(i)	iter_is_iovec(i)
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _FAULT_IN_VERSION_H
+#define _FAULT_IN_VERSION_H
+
+#include <linux/version.h>
+#include <linux/uio.h>
+#include <linux/pagemap.h>
+
+/*
+ * Faulting in the user memory behind an iterator, before copying to
+ * or from it again with page faults disabled. Since 5.16 both return
+ * how much could not be faulted in; before, there was only the
+ * readable side for iterators, and the first segment is done by hand
+ * for the writeable one (the caller comes back for the rest).
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+static inline size_t fault_in_iov_iter_readable(const struct iov_iter *i,
+		size_t size)
+{
+	return iov_iter_fault_in_readable(i, size) ? size : 0;
+}
+
+static inline size_t fault_in_iov_iter_writeable(const struct iov_iter *i,
+		size_t size)
+{
+	struct iovec iov;
+
+	if (!iter_is_iovec(i))
+		return 0; /* kernel memory doesn't fault */
+	iov = iov_iter_iovec(i);
+	if (fault_in_pages_writeable(iov.iov_base, min(size, iov.iov_len)))
+		return size;
+	return 0;
+}
+#endif
+
+#endif
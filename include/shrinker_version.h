@@ -0,0 +1,67 @@
+#ifndef _SHRINKER_VERSION_H
+#define _SHRINKER_VERSION_H
+
+#include <linux/version.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+/*
+ * Shrinkers got a name in 6.0, and have been allocated by the core
+ * since 6.7; before that they were embedded by their users. Either
+ * way, the wrappers hand out a registered shrinker, or NULL.
+ */
+static inline struct shrinker *shrinker_alloc_wrapper(unsigned int flags,
+		const char *name,
+		unsigned long (*count)(struct shrinker *,
+				struct shrink_control *),
+		unsigned long (*scan)(struct shrinker *,
+				struct shrink_control *))
+{
+	struct shrinker *s;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	int err = 0;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	s = shrinker_alloc(flags, "%s", name);
+	if (!s)
+		return NULL;
+	s->count_objects = count;
+	s->scan_objects = scan;
+	shrinker_register(s);
+#else
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	s->count_objects = count;
+	s->scan_objects = scan;
+	s->seeks = DEFAULT_SEEKS;
+	s->flags = flags;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	err = register_shrinker(s, "%s", name);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	err = register_shrinker(s);
+#else
+	register_shrinker(s);
+#endif
+	if (err) {
+		kfree(s);
+		return NULL;
+	}
+#endif
+	return s;
+}
+
+static inline void shrinker_free_wrapper(struct shrinker *s)
+{
+	if (!s)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free(s);
+#else
+	unregister_shrinker(s);
+	kfree(s);
+#endif
+}
+
+#endif
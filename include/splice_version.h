@@ -0,0 +1,26 @@
+#ifndef _SPLICE_VERSION_H
+#define _SPLICE_VERSION_H
+
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/splice.h>
+
+/*
+ * The generic splice_read for files with a read_iter method was
+ * renamed (and stopped going through the page cache) in 6.5.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define copy_splice_read generic_file_splice_read
+#endif
+
+/*
+ * Operations for pipe buffers referencing pages we own; ->confirm
+ * became optional in 5.8.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#define __add_pipe_buf_confirm	.confirm = generic_pipe_buf_confirm,
+#else
+#define __add_pipe_buf_confirm
+#endif
+
+#endif
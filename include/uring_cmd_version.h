@@ -0,0 +1,23 @@
+#ifndef _URING_CMD_VERSION_H
+#define _URING_CMD_VERSION_H
+
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * io_uring passthrough commands (f_op->uring_cmd) appeared in 5.19,
+ * and the payload went behind an accessor in 6.6. Commands complete
+ * inline, so there's no f_op->uring_cmd_iopoll: IORING_SETUP_IOPOLL
+ * rings can't use them.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define io_uring_sqe_cmd_wrapper(ioucmd)	io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define io_uring_sqe_cmd_wrapper(ioucmd)	((ioucmd)->cmd)
+#endif
+
+#endif
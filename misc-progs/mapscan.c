@@ -0,0 +1,100 @@
+/*
+ * mapscan.c -- scan a mapped scullp device, counting page faults
+ *
+ * The device is filled with "megabytes" of data, then mapped and read
+ * a word per page, a few times over. Load scullp with "scullp_huge=1"
+ * to compare PMD mappings with the default 4KB ones: the first pass
+ * shows the faults, the others the TLB misses.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define BLOCK (1024 * 1024)
+#define PASSES 4
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *what)
+{
+    fprintf(stderr, "mapscan: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static long faults(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+int main(int argc, char **argv)
+{
+    char *dev = "/dev/scullp0", *buf, *map;
+    int megs = 256, fd, i, pass;
+    long page = sysconf(_SC_PAGESIZE), f0;
+    size_t size, off;
+    volatile unsigned long sum = 0;
+    double t0;
+
+    if (argc > 1)
+        dev = argv[1];
+    if (argc > 2)
+        megs = atoi(argv[2]);
+    if (argc > 3 || megs <= 0) {
+        fprintf(stderr, "%s: Usage \"%s [device [megabytes]]\"\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    size = (size_t)megs << 20;
+
+    fd = open(dev, O_WRONLY); /* trims the device */
+    buf = malloc(BLOCK);
+    if (fd < 0 || !buf)
+        die(dev);
+    memset(buf, 0x5a, BLOCK);
+    for (i = 0; i < megs; i++)
+        if (write(fd, buf, BLOCK) != BLOCK)
+            die("write");
+    close(fd);
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0)
+        die(dev);
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        die("mmap");
+    for (pass = 0; pass < PASSES; pass++) {
+        f0 = faults();
+        t0 = now();
+        for (off = 0; off < size; off += page)
+            sum += *(unsigned long *)(map + off);
+        printf("pass %i: %8.2f ms, %7li faults\n", pass,
+               (now() - t0) * 1e3, faults() - f0);
+    }
+    munmap(map, size);
+    close(fd);
+    return 0;
+}
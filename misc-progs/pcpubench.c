@@ -0,0 +1,135 @@
+/*
+ * pcpubench.c -- concurrent writers on scullpcpu
+ *
+ * "threads" threads append "msglen"-byte records to the device for a
+ * few seconds, then everything is read back and checked to be in
+ * timestamp order. Run it on /dev/scull0 (which has no records and is
+ * not checked) to compare with a device where all writers share locks.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../scull/scull.h"
+
+#define MAXTHREADS 256
+#define BUFSIZE (1024 * 1024)
+
+static char *dev = "/dev/scullpcpu";
+static int msglen = 64, seconds = 3;
+static volatile int stop;
+
+struct writer {
+    pthread_t thread;
+    unsigned long long records;
+};
+
+static void die(char *what)
+{
+    fprintf(stderr, "pcpubench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void *writer(void *arg)
+{
+    struct writer *w = arg;
+    char buf[4096];
+    int fd;
+
+    fd = open(dev, O_WRONLY | O_APPEND);
+    if (fd < 0)
+        die(dev);
+    memset(buf, 0x5a, msglen);
+    while (!stop) {
+        if (write(fd, buf, msglen) != msglen)
+            die("write");
+        w->records++;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Read everything back, checking the order; return the record count */
+static long long check(void)
+{
+    char *buf = malloc(BUFSIZE);
+    unsigned long long last = 0;
+    struct scull_pc_rec *rec;
+    long long n = 0;
+    ssize_t len, off;
+    int fd;
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0 || !buf)
+        die(dev);
+    while ((len = read(fd, buf, BUFSIZE)) > 0) {
+        for (off = 0; off < len; off += sizeof(*rec) + rec->len) {
+            rec = (struct scull_pc_rec *)(buf + off);
+            if (rec->ts < last) {
+                fprintf(stderr, "pcpubench: record %lli out of order\n", n);
+                exit(1);
+            }
+            last = rec->ts;
+            n++;
+        }
+    }
+    if (len < 0)
+        die("read");
+    close(fd);
+    free(buf);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    static struct writer w[MAXTHREADS];
+    unsigned long long total = 0;
+    int nthreads = 32, i, fd;
+
+    if (argc > 1)
+        dev = argv[1];
+    if (argc > 2)
+        nthreads = atoi(argv[2]);
+    if (argc > 3)
+        msglen = atoi(argv[3]);
+    if (argc > 4 || nthreads <= 0 || nthreads > MAXTHREADS
+        || msglen <= 0 || msglen > 4096) {
+        fprintf(stderr, "%s: Usage \"%s [device [threads [msglen]]]\"\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+
+    /* start empty */
+    fd = open(dev, O_WRONLY | O_TRUNC);
+    if (fd < 0)
+        die(dev);
+    close(fd);
+
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&w[i].thread, NULL, writer, w + i);
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(w[i].thread, NULL);
+        total += w[i].records;
+    }
+    printf("%i writers: %10.0f records/s\n", nthreads,
+           (double)total / seconds);
+    if (strstr(dev, "pcpu"))
+        printf("read back %lli records, in order\n", check());
+    return 0;
+}
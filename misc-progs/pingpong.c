@@ -0,0 +1,198 @@
+/*
+ * pingpong.c -- round-trip latency over two mapped scullpipe rings
+ *
+ * Two ring-mode scullpipe devices are mapped, one for each direction.
+ * The parent writes a message in the first ring and waits for it to
+ * come back in the second one; the child echoes it. Messages are
+ * copied straight into the mapped buffer and the indices are moved by
+ * hand, so no system call is made as long as the peer is awake: the
+ * SCULL_P_IOCWAKE doorbell is only rung when the peer announced it is
+ * going to sleep in poll(). Load scull with "scull_p_ring=6" to get
+ * scullpipe1 and scullpipe2 in ring mode.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "../scull/scull.h"
+
+#define SPIN 1000 /* polls of the index before going to sleep */
+
+struct ring {
+    int fd;
+    struct scull_p_ring *ctl;
+    char *data;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *what)
+{
+    fprintf(stderr, "pingpong: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void ring_map(struct ring *r, char *dev)
+{
+    struct scull_p_ring *ctl;
+    long page = sysconf(_SC_PAGESIZE);
+
+    r->fd = open(dev, O_RDWR);
+    if (r->fd < 0)
+        die(dev);
+    /* map the control page alone first, to learn the ring size */
+    ctl = mmap(NULL, page, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (ctl == MAP_FAILED)
+        die(dev);
+    r->ctl = mmap(NULL, page + ctl->size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, r->fd, 0);
+    if (r->ctl == MAP_FAILED)
+        die(dev);
+    munmap(ctl, page);
+    r->data = (char *)r->ctl + page;
+}
+
+/* Sleep until "*index" moves away from "old", setting "*waiting" */
+static unsigned int ring_wait(struct ring *r, unsigned int *index,
+                              unsigned int *waiting, unsigned int old,
+                              short events)
+{
+    struct pollfd pfd = { .fd = r->fd, .events = events };
+    unsigned int val;
+    int i;
+
+    for (i = 0; i < SPIN; i++)
+        if ((val = __atomic_load_n(index, __ATOMIC_ACQUIRE)) != old)
+            return val;
+    for (;;) {
+        __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+        /* pairs with the fence of the peer, after moving the index */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((val = __atomic_load_n(index, __ATOMIC_ACQUIRE)) != old)
+            break;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            die("poll");
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return val;
+}
+
+/* Publish a new index value, and ring the doorbell if the peer sleeps */
+static void ring_publish(struct ring *r, unsigned int *index,
+                         unsigned int *waiting, unsigned int val)
+{
+    __atomic_store_n(index, val, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)
+        && ioctl(r->fd, SCULL_P_IOCWAKE) < 0)
+        die("ioctl");
+}
+
+static void ring_send(struct ring *r, char *buf, unsigned int len)
+{
+    unsigned int size = r->ctl->size, tail = r->ctl->tail, head, off, first;
+
+    head = __atomic_load_n(&r->ctl->head, __ATOMIC_ACQUIRE);
+    while (size - (tail - head) < len)
+        head = ring_wait(r, &r->ctl->head, &r->ctl->wr_wait, head, POLLOUT);
+    off = tail & (size - 1);
+    first = len < size - off ? len : size - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, len - first);
+    ring_publish(r, &r->ctl->tail, &r->ctl->rd_wait, tail + len);
+}
+
+static void ring_recv(struct ring *r, char *buf, unsigned int len)
+{
+    unsigned int size = r->ctl->size, head = r->ctl->head, tail, off, first;
+
+    tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_ACQUIRE);
+    while (tail - head < len)
+        tail = ring_wait(r, &r->ctl->tail, &r->ctl->rd_wait, tail, POLLIN);
+    off = head & (size - 1);
+    first = len < size - off ? len : size - off;
+    memcpy(buf, r->data + off, first);
+    memcpy(buf + first, r->data, len - first);
+    ring_publish(r, &r->ctl->head, &r->ctl->wr_wait, head + len);
+}
+
+int main(int argc, char **argv)
+{
+    char *ping = "/dev/scullpipe1", *pong = "/dev/scullpipe2", *buf;
+    int count = 100000, len = 64, i, status;
+    struct ring a, b;
+    double t0, t;
+    pid_t pid;
+
+    if (argc > 2) {
+        ping = argv[1];
+        pong = argv[2];
+    }
+    if (argc > 3)
+        count = atoi(argv[3]);
+    if (argc > 4)
+        len = atoi(argv[4]);
+    if (argc == 2 || argc > 5 || count <= 0 || len <= 0) {
+        fprintf(stderr, "%s: Usage \"%s [dev1 dev2 [count [msglen]]]\"\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    buf = malloc(len);
+    if (!buf)
+        die("malloc");
+    memset(buf, 0x5a, len);
+    ring_map(&a, ping);
+    ring_map(&b, pong);
+    if (len > a.ctl->size || len > b.ctl->size) {
+        fprintf(stderr, "pingpong: message larger than the ring\n");
+        exit(1);
+    }
+
+    pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (!pid) {
+        /* child: echo everything from a to b */
+        for (i = 0; i < count; i++) {
+            ring_recv(&a, buf, len);
+            ring_send(&b, buf, len);
+        }
+        exit(0);
+    }
+
+    t0 = now();
+    for (i = 0; i < count; i++) {
+        ring_send(&a, buf, len);
+        ring_recv(&b, buf, len);
+    }
+    t = now() - t0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+        || WEXITSTATUS(status))
+        die("echo");
+    printf("%i round trips of %i bytes: %.0f ns each\n",
+           count, len, t * 1e9 / count);
+    return 0;
+}
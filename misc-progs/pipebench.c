@@ -0,0 +1,99 @@
+/*
+ * pipebench.c -- throughput of a scullpipe device
+ *
+ * A child process reads the pipe while the parent writes "megabytes"
+ * of data into it, "blocksize" bytes per call. Load scull with some
+ * devices in ring mode (e.g. "scull_p_ring=2" for scullpipe1) and run
+ * this on a mutex device and on a ring device to compare them.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *what)
+{
+    fprintf(stderr, "pipebench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *dev = "/dev/scullpipe0", *buf;
+    long long total, done;
+    int megs = 256, bs = 4096, fd, status;
+    ssize_t n;
+    double t0, t;
+    pid_t pid;
+
+    if (argc > 1)
+        dev = argv[1];
+    if (argc > 2)
+        megs = atoi(argv[2]);
+    if (argc > 3)
+        bs = atoi(argv[3]);
+    if (argc > 4 || megs <= 0 || bs <= 0) {
+        fprintf(stderr, "%s: Usage \"%s [device [megabytes [blocksize]]]\"\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    total = (long long)megs << 20;
+    buf = malloc(bs);
+    if (!buf)
+        die("malloc");
+    memset(buf, 0x5a, bs);
+
+    pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (!pid) {
+        /* child: the reader */
+        fd = open(dev, O_RDONLY);
+        if (fd < 0)
+            die(dev);
+        for (done = 0; done < total; done += n) {
+            n = read(fd, buf, bs);
+            if (n <= 0)
+                die("read");
+        }
+        exit(0);
+    }
+
+    fd = open(dev, O_WRONLY);
+    if (fd < 0)
+        die(dev);
+    t0 = now();
+    for (done = 0; done < total; done += n) {
+        n = write(fd, buf, total - done < bs ? total - done : bs);
+        if (n <= 0)
+            die("write");
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+        || WEXITSTATUS(status))
+        die("reader");
+    t = now() - t0;
+    printf("%s: %i MB in %.3f s, %.1f MB/s (%i-byte blocks)\n",
+           dev, megs, t, megs / t, bs);
+    return 0;
+}
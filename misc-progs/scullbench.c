@@ -0,0 +1,146 @@
+/*
+ * scullbench.c -- the same workload on each scull allocation method
+ *
+ * For each method, the device is switched to it (this needs root),
+ * then filled with "megabytes" of data, read back and trimmed, a few
+ * times over. Throughput is printed with the percentiles of the time
+ * taken by quantum allocations, as histogrammed by the driver. The
+ * "arena" method needs scull_arena to be large enough for the data.
+ * The scullbench module (in scull/) runs the same rounds in the
+ * kernel, without the system calls and user copies.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "../scull/scull.h"
+
+#define BLOCK (64 * 1024)
+
+static char *methods[] = { "kmalloc", "cache", "pages", "vmalloc", "arena" };
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *what)
+{
+    fprintf(stderr, "scullbench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+/* Upper bound, in ns, of the bucket holding the "p" fraction */
+static unsigned long long percentile(unsigned long long *hist, double p)
+{
+    unsigned long long total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+        total += hist[i];
+    for (i = 0; i < SCULL_HIST_BUCKETS; i++) {
+        sum += hist[i];
+        if (sum && sum >= p * total)
+            break;
+    }
+    return i < SCULL_HIST_BUCKETS ? 1ULL << i : 0;
+}
+
+static void run(char *dev, char *method, int megs, int rounds)
+{
+    struct scull_alloc_stat stat;
+    unsigned long long hist[SCULL_HIST_BUCKETS], failed = 0;
+    char name[SCULL_ALLOC_NAMELEN], *buf = malloc(BLOCK);
+    double t, tw = 0, tr = 0, tt = 0;
+    long long bytes = (long long)megs << 20, done;
+    int fd, i, r;
+    ssize_t n;
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0 || !buf)
+        die(dev);
+    memset(name, 0, sizeof(name));
+    strncpy(name, method, sizeof(name) - 1);
+    if (ioctl(fd, SCULL_IOCSALLOC, name) < 0)
+        die(method);
+    close(fd);
+    memset(hist, 0, sizeof(hist));
+    memset(buf, 0x5a, BLOCK);
+
+    for (r = 0; r < rounds; r++) {
+        t = now();
+        fd = open(dev, O_WRONLY); /* trims what the last round left */
+        if (fd < 0)
+            die(dev);
+        tt += now() - t;
+        t = now();
+        for (done = 0; done < bytes; done += n)
+            if ((n = write(fd, buf, BLOCK)) <= 0)
+                die("write");
+        tw += now() - t;
+        if (ioctl(fd, SCULL_IOCGALLOCSTAT, &stat) < 0)
+            die("ioctl");
+        for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+            hist[i] += stat.hist[i];
+        failed += stat.failed;
+        close(fd);
+
+        fd = open(dev, O_RDONLY);
+        if (fd < 0)
+            die(dev);
+        t = now();
+        while ((n = read(fd, buf, BLOCK)) > 0)
+            ;
+        if (n < 0)
+            die("read");
+        tr += now() - t;
+        close(fd);
+    }
+    printf("%-8s write %8.1f MB/s, read %8.1f MB/s, trim %7.2f ms, "
+           "alloc p50 %6llu p90 %6llu p99 %6llu max %8llu ns",
+           stat.name, (double)megs * rounds / tw, (double)megs * rounds / tr,
+           tt * 1e3 / rounds, percentile(hist, 0.5), percentile(hist, 0.9),
+           percentile(hist, 0.99), percentile(hist, 1.0));
+    if (failed)
+        printf(", %llu failed", failed);
+    printf("\n");
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    char *dev = "/dev/scull0";
+    int megs = 8, rounds = 10, i;
+
+    if (argc > 1)
+        dev = argv[1];
+    if (argc > 2)
+        megs = atoi(argv[2]);
+    if (argc > 3)
+        rounds = atoi(argv[3]);
+    if (argc > 4 || megs <= 0 || rounds <= 0) {
+        fprintf(stderr, "%s: Usage \"%s [device [megabytes [rounds]]]\"\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+        run(dev, methods[i], megs, rounds);
+    return 0;
+}
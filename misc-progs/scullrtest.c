@@ -0,0 +1,147 @@
+/*
+ * scullrtest.c -- parallel read throughput of a scull device
+ *
+ * The device is filled with "size" megabytes, then 1, 2, 4 and 8
+ * threads read it concurrently for a few seconds each, every thread
+ * in its own slice of the device (so on different quantum sets, as
+ * long as the slices are larger than a qset). With per-qset locking
+ * the aggregate throughput should grow with the number of threads.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BLOCK (64 * 1024)
+#define MAXTHREADS 8
+
+static char *dev = "/dev/scull0";
+static off_t devsize;
+static int seconds = 3;
+static volatile int stop;
+
+struct reader {
+    pthread_t thread;
+    off_t start, len;
+    unsigned long long bytes;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader(void *arg)
+{
+    struct reader *r = arg;
+    char *buf = malloc(BLOCK);
+    off_t pos = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0 || !buf) {
+        perror(dev);
+        exit(1);
+    }
+    while (!stop) {
+        n = pread(fd, buf, BLOCK, r->start + pos);
+        if (n <= 0) {
+            perror("pread");
+            exit(1);
+        }
+        r->bytes += n;
+        pos += n;
+        if (pos >= r->len)
+            pos = 0;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int fill(void)
+{
+    char *buf = malloc(BLOCK);
+    off_t pos;
+    int fd;
+
+    fd = open(dev, O_WRONLY); /* trims the device */
+    if (fd < 0 || !buf)
+        return -1;
+    memset(buf, 0x5a, BLOCK);
+    for (pos = 0; pos < devsize; pos += BLOCK)
+        if (write(fd, buf, BLOCK) != BLOCK)
+            return -1;
+    free(buf);
+    return close(fd);
+}
+
+static void run(int nthreads)
+{
+    struct reader r[MAXTHREADS];
+    unsigned long long total = 0;
+    double t0, t;
+    int i;
+
+    memset(r, 0, sizeof(r));
+    stop = 0;
+    t0 = now();
+    for (i = 0; i < nthreads; i++) {
+        r[i].len = devsize / nthreads / BLOCK * BLOCK;
+        r[i].start = i * r[i].len;
+        pthread_create(&r[i].thread, NULL, reader, r + i);
+    }
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(r[i].thread, NULL);
+        total += r[i].bytes;
+    }
+    t = now() - t0;
+    printf("%i thread%s: %10.1f MB/s\n", nthreads, nthreads > 1 ? "s" : " ",
+           total / t / (1 << 20));
+}
+
+int main(int argc, char **argv)
+{
+    int size = 256, n;
+
+    if (argc > 1)
+        dev = argv[1];
+    if (argc > 2)
+        size = atoi(argv[2]);
+    if (argc > 3)
+        seconds = atoi(argv[3]);
+    if (argc > 4 || size <= 0 || seconds <= 0) {
+        fprintf(stderr, "%s: Usage \"%s [device [megabytes [seconds]]]\"\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    devsize = (off_t)size << 20;
+
+    if (fill() < 0) {
+        fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+        exit(1);
+    }
+    for (n = 1; n <= MAXTHREADS; n *= 2)
+        run(n);
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * uringbench.c -- io_uring reads of a scull device at growing queue depths
+ *
+ * The device (scullc, scullp, scullv or sculld, whose read_iter is
+ * asynchronous) is filled with "megabytes" of data, then read back
+ * with IORING_OP_READ, "block" bytes at a time, keeping 1, 2, 4 ... 64
+ * requests in flight. For each depth the program prints the number of
+ * reads per second, the throughput and the mean latency of a read.
+ * No liburing here: the ring is set up by hand.
+ *
+ * With "poll" set, the reads are O_DIRECT and the ring is polled
+ * (IORING_SETUP_IOPOLL) instead of waiting for completions: meant for
+ * sbull loaded with poll_queues, which must be big enough for the data
+ * (nsectors), to compare against its other completion modes.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#define _GNU_SOURCE	/* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define MAXDEPTH 64
+
+struct ring {
+    int fd;
+    void *sq, *cq;
+    size_t sqlen, cqlen, sqelen;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *what)
+{
+    fprintf(stderr, "uringbench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void *map(int fd, size_t len, off_t what)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, what);
+
+    if (p == MAP_FAILED)
+        die("mmap");
+    return p;
+}
+
+static void ring_setup(struct ring *r, unsigned entries, unsigned flags)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = flags;
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        die("io_uring_setup");
+    r->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqelen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq = map(r->fd, r->sqlen, IORING_OFF_SQ_RING);
+    r->cq = map(r->fd, r->cqlen, IORING_OFF_CQ_RING);
+    r->sqes = map(r->fd, r->sqelen, IORING_OFF_SQES);
+    r->sq_tail = r->sq + p.sq_off.tail;
+    r->sq_mask = r->sq + p.sq_off.ring_mask;
+    r->sq_array = r->sq + p.sq_off.array;
+    r->cq_head = r->cq + p.cq_off.head;
+    r->cq_tail = r->cq + p.cq_off.tail;
+    r->cq_mask = r->cq + p.cq_off.ring_mask;
+    r->cqes = r->cq + p.cq_off.cqes;
+}
+
+static void ring_free(struct ring *r)
+{
+    munmap(r->sqes, r->sqelen);
+    munmap(r->cq, r->cqlen);
+    munmap(r->sq, r->sqlen);
+    close(r->fd);
+}
+
+/* Queue a read of "len" bytes at "off" into "buf", tagged with "slot" */
+static void queue_read(struct ring *r, int fd, void *buf, unsigned len,
+                       long long off, int slot)
+{
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = r->sqes + idx;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = slot;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void run(char *dev, int depth, long long bytes, int block, int poll)
+{
+    static char *bufs[MAXDEPTH];
+    double start[MAXDEPTH], t, lat = 0;
+    long long off = 0, ops = 4 * (bytes / block), issued = 0, done = 0;
+    unsigned head, tail, submit = 0;
+    struct io_uring_cqe *cqe;
+    struct ring r;
+    int fd, i;
+
+    fd = open(dev, poll ? O_RDONLY | O_DIRECT : O_RDONLY);
+    if (fd < 0)
+        die(dev);
+    ring_setup(&r, depth, poll ? IORING_SETUP_IOPOLL : 0);
+    for (i = 0; i < depth; i++) /* aligned, for O_DIRECT */
+        if (!bufs[i] && posix_memalign((void **)&bufs[i], 4096, block))
+            die("malloc");
+
+    t = now();
+    for (i = 0; i < depth && issued < ops; i++, issued++, submit++) {
+        start[i] = now();
+        queue_read(&r, fd, bufs[i], block, off, i);
+        off = (off + block) % bytes;
+    }
+    while (done < ops) {
+        if (syscall(__NR_io_uring_enter, r.fd, submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            die("io_uring_enter");
+        submit = 0;
+        head = *r.cq_head;
+        tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = r.cqes + (head & *r.cq_mask);
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                die("read");
+            }
+            i = cqe->user_data;
+            lat += now() - start[i];
+            done++;
+            if (issued < ops) { /* reuse the slot right away */
+                start[i] = now();
+                queue_read(&r, fd, bufs[i], block, off, i);
+                off = (off + block) % bytes;
+                issued++;
+                submit++;
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+    t = now() - t;
+    printf("qd %3i: %9.0f reads/s %9.1f MB/s, %8.1f us per read\n", depth,
+           ops / t, (double)ops * block / t / (1 << 20), lat * 1e6 / ops);
+    ring_free(&r);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    char *dev = "/dev/scullp0", *buf;
+    int megs = 16, block = 4096, poll = 0, depth;
+    long long bytes, done;
+    ssize_t n;
+    int fd;
+
+    if (argc > 1)
+        dev = argv[1];
+    if (argc > 2)
+        megs = atoi(argv[2]);
+    if (argc > 3)
+        block = atoi(argv[3]);
+    if (argc > 4)
+        poll = atoi(argv[4]);
+    if (argc > 5 || megs <= 0 || block <= 0) {
+        fprintf(stderr, "%s: Usage \"%s [device [megabytes [block"
+                " [poll]]]]\"\n", argv[0], argv[0]);
+        exit(1);
+    }
+    bytes = (long long)megs << 20;
+
+    /* fill the device first (opening it write-only trims it) */
+    fd = open(dev, O_WRONLY);
+    buf = malloc(block);
+    if (fd < 0 || !buf)
+        die(dev);
+    memset(buf, 0x5a, block);
+    for (done = 0; done < bytes; done += n)
+        if ((n = write(fd, buf, block)) <= 0)
+            die("write");
+    close(fd);
+    free(buf);
+
+    for (depth = 1; depth <= MAXDEPTH; depth *= 2)
+        run(dev, depth, bytes, block, poll);
+    return 0;
+}
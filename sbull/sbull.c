@@ -24,11 +24,18 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/hdreg.h>	/* HDIO_GETGEO */
 #include <linux/kdev_t.h>
-#include <linux/vmalloc.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>	/* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -40,6 +47,35 @@ static int nsectors = 1024;	/* How big the drive is */
 module_param(nsectors, int, 0);
 static int ndevices = 4;
 module_param(ndevices, int, 0);
+static int nr_hw_queues = 0;	/* Hardware queues: 0 is one per CPU */
+module_param(nr_hw_queues, int, 0);
+static int queue_depth = 128;	/* Requests in flight per queue */
+module_param(queue_depth, int, 0);
+static int poll_queues = 0;	/* More hardware queues, for polled I/O */
+module_param(poll_queues, int, 0);
+
+/*
+ * How the blk-mq request functions tell the block layer a request is
+ * done. The data is always moved by the request function itself; what
+ * changes is how the completion comes back, as it would from a real
+ * controller: right away, from the block softirq (like an interrupt
+ * handler would hand it over), or from a timer completion_nsec later.
+ * The timer mode is just the default of the latency of each device,
+ * which (with the rest of its emulated "hardware", below) can then be
+ * changed in sysfs; whatever the mode, a request with time to wait
+ * is completed by its timer. Requests on the poll queues wait for the
+ * submitter to poll for them (and for their time).
+ * The bio-based mode (RM_NOQUEUE) has no queues, and ends bios inline.
+ */
+enum {
+	SBULL_COMPLETE_INLINE  = 0,
+	SBULL_COMPLETE_SOFTIRQ = 1,
+	SBULL_COMPLETE_TIMER   = 2,
+};
+static int completion_mode = SBULL_COMPLETE_INLINE;
+module_param(completion_mode, int, 0);
+static unsigned long completion_nsec = 10000;	/* For the timer mode */
+module_param(completion_nsec, ulong, 0);
 
 /*
  * The different "request modes" we can use.
@@ -70,23 +106,76 @@ module_param(request_mode, int, 0);
  */
 #define INVALIDATE_DELAY	30*HZ
 
+/*
+ * What each hardware queue of a device keeps to itself: requests on
+ * different queues share nothing. Only poll queues take a lock, for
+ * the list of the requests they have done.
+ */
+struct sbull_queue {
+	struct sbull_dev *dev;
+	spinlock_t lock;
+	struct list_head done;		/* Waiting to be polled for */
+};
+
+/*
+ * And what each request carries with it (the "pdu" blk-mq allocates
+ * behind it), until it's completed.
+ */
+struct sbull_cmd {
+	struct list_head list;		/* On the done list of a poll queue */
+	struct hrtimer timer;		/* To complete it at its deadline */
+	u64 deadline;			/* In ns, 0 if none */
+	blk_status_t status;
+};
+
+/*
+ * How long requests take on top of the time to move their data.
+ */
+enum {
+	SBULL_LAT_FIXED     = 0,	/* latency_ns, always */
+	SBULL_LAT_UNIFORM   = 1,	/* latency_ns, give or take jitter */
+	SBULL_LAT_LOGNORMAL = 2,	/* of median latency_ns */
+};
+static const char * const sbull_lat_names[] = {
+	"fixed", "uniform", "lognormal"
+};
+
 /*
  * The internal representation of our device.
  */
 struct sbull_dev {
-        int size;                       /* Device size in sectors */
-        u8 *data;                       /* The data array */
+        u64 size;                       /* Device size in bytes */
+        struct xarray pages;            /* The data, a page at a time */
+        gfp_t gfp;                      /* How to allocate them */
         short users;                    /* How many users */
         short media_change;             /* Flag a media change? */
-        spinlock_t lock;                /* For mutual exclusion */
+        spinlock_t lock;                /* For open, release and the timer */
 	struct blk_mq_tag_set tag_set;	/* tag_set added */
+	struct sbull_queue *queues;	/* One per hardware queue */
         struct request_queue *queue;    /* The device request queue */
         struct gendisk *gd;             /* The gendisk structure */
         struct timer_list timer;        /* For simulated media changes */
+	/* The "hardware" being emulated, see sbull_deadline */
+	int latency_dist;		/* SBULL_LAT_* */
+	u64 latency_ns;
+	u64 latency_jitter_ns;		/* For SBULL_LAT_UNIFORM */
+	u64 latency_sigma;		/* For SBULL_LAT_LOGNORMAL, x 1000 */
+	u64 bw_limit;			/* Bytes per second, 0 for none */
+	u64 iops_limit;			/* Requests per second, 0 for none */
+	spinlock_t busy_lock;
+	u64 busy_until;			/* When the caps let the next one go */
 };
 
 static struct sbull_dev *Devices = NULL;
 
+/*
+ * Short-lived mappings of (high memory) pages got cheaper in 5.11.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0))
+#define kmap_local_page	kmap_atomic
+#define kunmap_local	kunmap_atomic
+#endif
+
 /**
 * See https://github.com/openzfs/zfs/pull/10187/
 */
@@ -112,22 +201,280 @@ blk_generic_alloc_queue(int node_id)
 }
 
 /*
- * Handle an I/O request.
+ * The data lives in pages, indexed by their number in the device and
+ * allocated by the first write to them: the memory used tracks what
+ * was written, not the size of the disk, and unwritten parts read as
+ * zeros. Readers and writers look pages up under RCU, so that discards
+ * can free them under their feet.
  */
-static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
-		unsigned long nsect, char *buffer, int write)
+static void sbull_free_page_rcu(struct rcu_head *head)
 {
-	unsigned long offset = sector*KERNEL_SECTOR_SIZE;
-	unsigned long nbytes = nsect*KERNEL_SECTOR_SIZE;
+	__free_page(container_of(head, struct page, rcu_head));
+}
 
-	if ((offset + nbytes) > dev->size) {
-		printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
+static struct page *sbull_get_page(struct sbull_dev *dev, pgoff_t index)
+{
+	struct page *page, *old;
+
+	page = xa_load(&dev->pages, index);
+	if (page)
+		return page;
+	page = alloc_page(dev->gfp | __GFP_ZERO | __GFP_NOWARN);
+	if (!page)
+		return NULL;
+	old = xa_cmpxchg(&dev->pages, index, NULL, page, dev->gfp);
+	if (old) { /* someone else was quicker, or no memory */
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+	return page;
+}
+
+/* Clear "nbytes" at "offset", all within one page */
+static void sbull_clear(struct sbull_dev *dev, u64 offset, unsigned int nbytes)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	page = xa_load(&dev->pages, offset >> PAGE_SHIFT);
+	if (page)
+		memset(page_address(page) + offset_in_page(offset), 0, nbytes);
+	rcu_read_unlock();
+}
+
+/*
+ * DISCARD and WRITE_ZEROES: both leave zeros behind. The pages the
+ * range covers entirely are freed, the ends of it are cleared.
+ */
+static void sbull_zero_range(struct sbull_dev *dev, u64 offset, u64 nbytes)
+{
+	pgoff_t first = DIV_ROUND_UP(offset, PAGE_SIZE);	/* whole pages: */
+	pgoff_t last = (offset + nbytes) >> PAGE_SHIFT;	/* [first, last) */
+	pgoff_t index;
+	struct page *page;
+
+	if (first > last) {
+		sbull_clear(dev, offset, nbytes);
 		return;
 	}
-	if (write)
-		memcpy(dev->data + offset, buffer, nbytes);
-	else
-		memcpy(buffer, dev->data + offset, nbytes);
+	if ((u64)first << PAGE_SHIFT > offset)
+		sbull_clear(dev, offset, ((u64)first << PAGE_SHIFT) - offset);
+	if ((u64)last << PAGE_SHIFT < offset + nbytes)
+		sbull_clear(dev, (u64)last << PAGE_SHIFT,
+				offset + nbytes - ((u64)last << PAGE_SHIFT));
+	if (first == last)
+		return;
+	xa_for_each_range(&dev->pages, index, page, first, last - 1) {
+		page = xa_erase(&dev->pages, index);
+		if (page) /* or a concurrent discard got it first */
+			call_rcu(&page->rcu_head, sbull_free_page_rcu);
+	}
+}
+
+/* All of them, when the media "changes" and at unload */
+static void sbull_free_pages(struct sbull_dev *dev)
+{
+	unsigned long index;
+	struct page *page;
+
+	xa_for_each(&dev->pages, index, page) {
+		page = xa_erase(&dev->pages, index);
+		if (page) /* or a concurrent discard got it first */
+			call_rcu(&page->rcu_head, sbull_free_page_rcu);
+	}
+}
+
+/*
+ * Handle an I/O request: copy one bvec from or to the device at "pos"
+ * (in bytes). A bvec may span several pages (see bio_for_each_bvec),
+ * which may be in high memory, and needn't be aligned on the pages of
+ * the device: go one piece of both at a time, straight between them.
+ */
+static blk_status_t sbull_transfer(struct sbull_dev *dev, struct bio_vec *bvec,
+		u64 pos, int write)
+{
+	unsigned int off = bvec->bv_offset, len = bvec->bv_len, chunk;
+	struct page *page, *bpage;
+	void *mem, *data;
+
+	if ((pos + len) > dev->size) {
+		printk (KERN_NOTICE "Beyond-end write (%lld %u)\n", pos, len);
+		return BLK_STS_IOERR;
+	}
+	for (; len; pos += chunk, off += chunk, len -= chunk) {
+		chunk = min3(len, (unsigned int)(PAGE_SIZE - offset_in_page(pos)),
+				(unsigned int)(PAGE_SIZE - offset_in_page(off)));
+		if (write && !sbull_get_page(dev, pos >> PAGE_SHIFT))
+			return BLK_STS_RESOURCE; /* blk-mq will retry */
+		bpage = nth_page(bvec->bv_page, off >> PAGE_SHIFT);
+		mem = kmap_local_page(bpage) + offset_in_page(off);
+		rcu_read_lock();
+		page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+		data = page ? page_address(page) + offset_in_page(pos) : NULL;
+		if (data && chunk == PAGE_SIZE) /* both page aligned */
+			write ? copy_page(data, mem) : copy_page(mem, data);
+		else if (data)
+			write ? memcpy(data, mem, chunk) : memcpy(mem, data, chunk);
+		else if (!write)
+			memset(mem, 0, chunk); /* never written */
+		rcu_read_unlock();
+		kunmap_local(mem);
+		if (!write)
+			flush_dcache_page(bpage);
+	}
+	return BLK_STS_OK;
+}
+
+/*
+ * The requests with no data.
+ */
+static bool sbull_no_data(struct request *req, blk_status_t *ret)
+{
+	struct sbull_dev *dev = req->q->queuedata;
+
+	switch (req_op(req)) {
+	    case REQ_OP_DISCARD:
+	    case REQ_OP_WRITE_ZEROES:
+		sbull_zero_range(dev, (u64)blk_rq_pos(req) * KERNEL_SECTOR_SIZE,
+				blk_rq_bytes(req));
+		*ret = BLK_STS_OK;
+		return true;
+	    case REQ_OP_FLUSH:
+		*ret = BLK_STS_OK; /* nothing is cached */
+		return true;
+	    default:
+		return false;
+	}
+}
+
+/*
+ * Completions. The status of the request was saved in its sbull_cmd
+ * by sbull_end_request, below.
+ */
+static void sbull_complete(struct request *req)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	blk_mq_end_request(req, cmd->status);
+}
+
+static enum hrtimer_restart sbull_timer_done(struct hrtimer *timer)
+{
+	struct sbull_cmd *cmd = container_of(timer, struct sbull_cmd, timer);
+
+	sbull_complete(blk_mq_rq_from_pdu(cmd));
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * A lognormal sample of median "median" and shape sigma/1000, without
+ * floating point: a normal one (twelve uniform ones, less six) in 16.16
+ * fixed point, times sigma and log2(e), is the power of two to raise:
+ * a shift for its integer part, a quadratic fit for the rest.
+ */
+static u64 sbull_lognormal(u64 median, u64 sigma)
+{
+	s64 z = 0, y;
+	u32 frac, p;
+	int i, n;
+
+	for (i = 0; i < 12; i++)
+		z += get_random_u32() >> 16;
+	z -= 6 << 16;
+	y = div_s64(z * (s64)sigma, 1000) * 94548 >> 16; /* 1.4427 << 16 */
+	n = y >> 16;
+	frac = y & 0xffff;
+	p = 65536 + (43024 * frac >> 16) +		/* 2^frac, 16.16 */
+		(u32)(22512 * ((u64)frac * frac >> 16) >> 16);
+	if (n < -40)
+		return 0;
+	n = min(n, 20);
+	median = mul_u64_u32_shr(median, p, 16);
+	return n >= 0 ? median << n : median >> -n;
+}
+
+static u64 sbull_latency(struct sbull_dev *dev)
+{
+	u64 ns = READ_ONCE(dev->latency_ns), jitter;
+
+	switch (READ_ONCE(dev->latency_dist)) {
+	    case SBULL_LAT_UNIFORM:
+		jitter = min(READ_ONCE(dev->latency_jitter_ns), ns);
+		return ns - jitter +
+			mul_u64_u32_shr(2 * jitter, get_random_u32(), 32);
+	    case SBULL_LAT_LOGNORMAL:
+		return ns ? sbull_lognormal(ns, READ_ONCE(dev->latency_sigma)) : 0;
+	    default:
+		return ns;
+	}
+}
+
+/*
+ * When a request should complete, in ns of the monotonic clock; 0 for
+ * right away. With a cap, the device is one channel the requests go
+ * through in turn, each keeping it busy for as long as its size takes
+ * at bw_limit or 1/iops_limit of a second, whichever is longer; the
+ * latency is added once it's through. As requests keep their tags
+ * until then, a slow device pushes back on its submitters.
+ *
+ * No request is held more than SBULL_MAX_DELAY, well below the block
+ * layer's timeout (30s): a lognormal tail or a backlog that would go
+ * further is cut there, and the caps are then not quite honoured.
+ */
+#define SBULL_MAX_DELAY	(10 * NSEC_PER_SEC)
+
+static u64 sbull_deadline(struct sbull_dev *dev, struct request *req)
+{
+	u64 bw = READ_ONCE(dev->bw_limit), iops = READ_ONCE(dev->iops_limit);
+	u64 latency = sbull_latency(dev), now, busy = 0, done;
+
+	if (!bw && !iops && !latency)
+		return 0;
+	now = done = ktime_get_ns();
+	if (iops)
+		busy = div64_u64(NSEC_PER_SEC, iops);
+	if (bw)
+		busy = max(busy, div64_u64((u64)blk_rq_bytes(req) * NSEC_PER_SEC,
+				bw));
+	if (busy) {
+		spin_lock(&dev->busy_lock);
+		done = min(max(dev->busy_until, now) + busy,
+				now + SBULL_MAX_DELAY);
+		dev->busy_until = done;
+		spin_unlock(&dev->busy_lock);
+	}
+	return min(done + min(latency, SBULL_MAX_DELAY), now + SBULL_MAX_DELAY);
+}
+
+static void sbull_end_request(struct blk_mq_hw_ctx *hctx, struct request *req,
+		blk_status_t status)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->status = status;
+	cmd->deadline = sbull_deadline(req->q->queuedata, req);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+	if (hctx->type == HCTX_TYPE_POLL) {
+		struct sbull_queue *sq = hctx->driver_data;
+
+		spin_lock(&sq->lock);
+		list_add_tail(&cmd->list, &sq->done);
+		spin_unlock(&sq->lock);
+		return;
+	}
+#endif
+	if (cmd->deadline) {
+		hrtimer_start(&cmd->timer, ns_to_ktime(cmd->deadline),
+				HRTIMER_MODE_ABS);
+		return;
+	}
+	switch (completion_mode) {
+	    case SBULL_COMPLETE_SOFTIRQ:
+		blk_mq_complete_request(req); /* calls sbull_complete */
+		break;
+	    default:
+		sbull_complete(req);
+	}
 }
 
 /*
@@ -137,11 +484,11 @@ static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
 static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data* bd)   /* For blk-mq */
 {
 	struct request *req = bd->rq;
-	struct sbull_dev *dev = req->rq_disk->private_data;
+	struct sbull_queue *sq = hctx->driver_data;
+	struct sbull_dev *dev = sq->dev;
         struct bio_vec bvec;
         struct req_iterator iter;
-        sector_t pos_sector = blk_rq_pos(req);
-	void	*buffer;
+	u64 pos = (u64)blk_rq_pos(req) * KERNEL_SECTOR_SIZE;
 	blk_status_t  ret;
 
 	blk_mq_start_request (req);
@@ -151,62 +498,61 @@ static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx, const struct blk_m
                 ret = BLK_STS_IOERR;  //-EIO
 			goto done;
 	}
-	rq_for_each_segment(bvec, req, iter)
+	if (sbull_no_data(req, &ret))
+		goto done;
+	pr_debug("Req dev %u dir %d sec %lld, nr %u\n",
+			(unsigned)(dev - Devices), rq_data_dir(req),
+			(long long)blk_rq_pos(req), blk_rq_sectors(req));
+	ret = BLK_STS_OK;
+	rq_for_each_bvec(bvec, req, iter)
 	{
-		size_t num_sector = blk_rq_cur_sectors(req);
-		printk (KERN_NOTICE "Req dev %u dir %d sec %lld, nr %ld\n",
-                        (unsigned)(dev - Devices), rq_data_dir(req),
-                        pos_sector, num_sector);
-		buffer = page_address(bvec.bv_page) + bvec.bv_offset;
-		sbull_transfer(dev, pos_sector, num_sector,
-				buffer, rq_data_dir(req) == WRITE);
-		pos_sector += num_sector;
+		ret = sbull_transfer(dev, &bvec, pos, rq_data_dir(req) == WRITE);
+		if (ret)
+			break;
+		pos += bvec.bv_len;
 	}
-	ret = BLK_STS_OK;
+	if (ret == BLK_STS_RESOURCE)
+		return ret; /* not ended: blk-mq requeues it */
 done:
-	blk_mq_end_request (req, ret);
-	return ret;
+	sbull_end_request(hctx, req, ret);
+	return BLK_STS_OK;
 }
 
 
 /*
  * Transfer a single BIO.
  */
-static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
+static blk_status_t sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 {
 	struct bio_vec bvec;
 	struct bvec_iter iter;
-	sector_t sector = bio->bi_iter.bi_sector;
-
-	/* Do each segment independently. */
-	bio_for_each_segment(bvec, bio, iter) {
-		//char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-		char *buffer = kmap_atomic(bvec.bv_page) + bvec.bv_offset;
-		//sbull_transfer(dev, sector, bio_cur_bytes(bio) >> 9,
-		sbull_transfer(dev, sector, (bio_cur_bytes(bio) / KERNEL_SECTOR_SIZE),
-				buffer, bio_data_dir(bio) == WRITE);
-		//sector += bio_cur_bytes(bio) >> 9;
-		sector += (bio_cur_bytes(bio) / KERNEL_SECTOR_SIZE);
-		//__bio_kunmap_atomic(buffer, KM_USER0);
-		kunmap_atomic(buffer);
+	u64 pos = (u64)bio->bi_iter.bi_sector * KERNEL_SECTOR_SIZE;
+	blk_status_t ret;
+
+	/* Do each segment independently, by its own length. */
+	bio_for_each_bvec(bvec, bio, iter) {
+		ret = sbull_transfer(dev, &bvec, pos, bio_data_dir(bio) == WRITE);
+		if (ret)
+			return ret;
+		pos += bvec.bv_len;
 	}
-	return 0; /* Always "succeed" */
+	return BLK_STS_OK;
 }
 
 /*
  * Transfer a full request.
  */
-static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
+static blk_status_t sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 {
 	struct bio *bio;
-	int nsect = 0;
+	blk_status_t ret;
     
 	__rq_for_each_bio(bio, req) {
-		sbull_xfer_bio(dev, bio);
-		//nsect += bio->bi_size/KERNEL_SECTOR_SIZE;
-		nsect += bio->bi_iter.bi_size/KERNEL_SECTOR_SIZE;
+		ret = sbull_xfer_bio(dev, bio);
+		if (ret)
+			return ret;
 	}
-	return nsect;
+	return BLK_STS_OK;
 }
 
 
@@ -218,9 +564,9 @@ static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 static blk_status_t sbull_full_request(struct blk_mq_hw_ctx * hctx, const struct blk_mq_queue_data * bd)
 {
 	struct request *req = bd->rq;
-	int sectors_xferred;
 	//struct sbull_dev *dev = q->queuedata;
-	struct sbull_dev *dev = req->q->queuedata;
+	struct sbull_queue *sq = hctx->driver_data;
+	struct sbull_dev *dev = sq->dev;
 	blk_status_t  ret;
 
 	blk_mq_start_request (req);
@@ -233,13 +579,16 @@ static blk_status_t sbull_full_request(struct blk_mq_hw_ctx * hctx, const struct
 			//continue;
 			goto done;
 		}
-		sectors_xferred = sbull_xfer_request(dev, req);
-		ret = BLK_STS_OK; 
+		if (sbull_no_data(req, &ret))
+			goto done;
+		ret = sbull_xfer_request(dev, req);
+		if (ret == BLK_STS_RESOURCE)
+			return ret; /* not ended: blk-mq requeues it */
 	done:
 		//__blk_end_request(req, 0, sectors_xferred);
-		blk_mq_end_request (req, ret);
+		sbull_end_request(hctx, req, ret);
 	//}
-	return ret;
+	return BLK_STS_OK;
 }
 
 
@@ -256,10 +605,17 @@ static blk_qc_t sbull_make_request(struct bio *bio)
 {
 	//struct sbull_dev *dev = q->queuedata;
 	struct sbull_dev *dev = bio->bi_disk->private_data;
-	int status;
 
-	status = sbull_xfer_bio(dev, bio);
-	bio->bi_status = status;
+	switch (bio_op(bio)) {
+	    case REQ_OP_DISCARD:
+	    case REQ_OP_WRITE_ZEROES:
+		sbull_zero_range(dev, (u64)bio->bi_iter.bi_sector * KERNEL_SECTOR_SIZE,
+				bio->bi_iter.bi_size);
+		bio->bi_status = BLK_STS_OK;
+		break;
+	    default:
+		bio->bi_status = sbull_xfer_bio(dev, bio);
+	}
 	bio_endio(bio);
 	return BLK_QC_T_NONE;
 }
@@ -334,7 +690,7 @@ int sbull_revalidate(struct gendisk *gd)
 	
 	if (dev->media_change) {
 		dev->media_change = 0;
-		memset (dev->data, 0, dev->size);
+		sbull_free_pages(dev);
 	}
 	return 0;
 }
@@ -354,7 +710,7 @@ void sbull_invalidate(struct timer_list * ldev)
 #endif
 
 	spin_lock(&dev->lock);
-	if (dev->users || !dev->data) 
+	if (dev->users) 
 		printk (KERN_WARNING "sbull: timer sanity check failed\n");
 	else
 		dev->media_change = 1;
@@ -380,7 +736,7 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 		 * and calculate the corresponding number of cylinders.  We set the
 		 * start of data at sector four.
 		 */
-		size = dev->size*(hardsect_size/KERNEL_SECTOR_SIZE);
+		size = dev->size/KERNEL_SECTOR_SIZE;
 		geo.cylinders = (size & ~0x3f) >> 6;
 		geo.heads = 4;
 		geo.sectors = 16;
@@ -393,10 +749,107 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 	return -ENOTTY; /* unknown command */
 }
 
+/*
+ * The emulation knobs, in /sys/block/sbull?/sbull/, so that they can
+ * be changed with requests in flight: these use what they find.
+ */
+static ssize_t latency_dist_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;
+	int i, len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(sbull_lat_names); i++)
+		len += sprintf(buf + len, i == dev->latency_dist ? "[%s] " : "%s ",
+				sbull_lat_names[i]);
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t latency_dist_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;
+	int i = sysfs_match_string(sbull_lat_names, buf);
 
+	if (i < 0)
+		return i;
+	WRITE_ONCE(dev->latency_dist, i);
+	return count;
+}
+static DEVICE_ATTR_RW(latency_dist);
 
 /*
- * The device operations structure.
+ * The other knobs take a number within limits, 0 always meaning "off".
+ * Whichever changes, the backlog built up under the old settings is
+ * forgotten: it could be hours long after a too low cap.
+ */
+static void sbull_knob_changed(struct sbull_dev *dev)
+{
+	spin_lock(&dev->busy_lock);
+	dev->busy_until = 0;
+	spin_unlock(&dev->busy_lock);
+}
+
+#define SBULL_KNOB(name, min, max)					\
+static ssize_t name##_show(struct device *d,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;		\
+									\
+	return sprintf(buf, "%llu\n", READ_ONCE(dev->name));		\
+}									\
+static ssize_t name##_store(struct device *d,				\
+		struct device_attribute *attr, const char *buf, size_t count) \
+{									\
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;		\
+	u64 val;							\
+	int err = kstrtou64(buf, 0, &val);				\
+									\
+	if (err)							\
+		return err;						\
+	if (val && (val < (min) || val > (max)))			\
+		return -EINVAL;						\
+	WRITE_ONCE(dev->name, val);					\
+	sbull_knob_changed(dev);					\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(name)
+
+/* At least 1MB/s, so that one large request fits in SBULL_MAX_DELAY */
+SBULL_KNOB(latency_ns, 1, SBULL_MAX_DELAY);
+SBULL_KNOB(latency_jitter_ns, 1, SBULL_MAX_DELAY);
+SBULL_KNOB(latency_sigma, 1, 4000);
+SBULL_KNOB(bw_limit, 1 << 20, U64_MAX);
+SBULL_KNOB(iops_limit, 1, NSEC_PER_SEC);
+
+static struct attribute *sbull_attrs[] = {
+	&dev_attr_latency_dist.attr,
+	&dev_attr_latency_ns.attr,
+	&dev_attr_latency_jitter_ns.attr,
+	&dev_attr_latency_sigma.attr,
+	&dev_attr_bw_limit.attr,
+	&dev_attr_iops_limit.attr,
+	NULL,
+};
+
+static const struct attribute_group sbull_attr_group = {
+	.name = "sbull",
+	.attrs = sbull_attrs,
+};
+
+static const struct attribute_group *sbull_attr_groups[] = {
+	&sbull_attr_group,
+	NULL,
+};
+
+
+
+/*
+ * The device operations structure. Since 5.9, a disk with a
+ * submit_bio method gets every bio handed to it, and never to its
+ * queue: only RM_NOQUEUE may have one, or the blk-mq modes would
+ * quietly turn bio-based.
  */
 static struct block_device_operations sbull_ops = {
 	.owner           = THIS_MODULE,
@@ -404,6 +857,17 @@ static struct block_device_operations sbull_ops = {
 	.release 	 = sbull_release,
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
 	.media_changed   = sbull_media_changed,  // DEPRECATED in v5.9
+#endif
+	.revalidate_disk = sbull_revalidate,
+	.ioctl	         = sbull_ioctl
+};
+
+static struct block_device_operations sbull_bio_ops = {
+	.owner           = THIS_MODULE,
+	.open 	         = sbull_open,
+	.release 	 = sbull_release,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
+	.media_changed   = sbull_media_changed,  // DEPRECATED in v5.9
 #else
 	.submit_bio      = sbull_make_request,
 #endif
@@ -411,14 +875,170 @@ static struct block_device_operations sbull_ops = {
 	.ioctl	         = sbull_ioctl
 };
 
+/*
+ * Point each hardware context to its own state.
+ */
+static int sbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+		unsigned int index)
+{
+	struct sbull_dev *dev = data;
+
+	hctx->driver_data = dev->queues + index;
+	return 0;
+}
+
+/* And each request, once, to its timer */
+static int sbull_init_request(struct blk_mq_tag_set *set, struct request *req,
+		unsigned int hctx_idx, unsigned int numa_node)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	INIT_LIST_HEAD(&cmd->list);
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	cmd->timer.function = sbull_timer_done;
+	return 0;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+/*
+ * The first nr_hw_queues hardware queues take the usual I/O, the
+ * poll_queues after them the polled I/O (REQ_HIPRI, or REQ_POLLED):
+ * each set spread over all the CPUs. Nothing is kept apart for reads.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0))
+static int sbull_map_queues(struct blk_mq_tag_set *set)
+#else
+static void sbull_map_queues(struct blk_mq_tag_set *set)
+#endif
+{
+	struct blk_mq_queue_map *map;
+	unsigned int i, offset = 0;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		map = &set->map[i];
+		switch (i) {
+		    case HCTX_TYPE_DEFAULT:
+			map->nr_queues = nr_hw_queues;
+			break;
+		    case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
+		    default:
+			map->nr_queues = 0; /* blk-mq uses the default ones */
+			continue;
+		}
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0))
+	return 0;
+#endif
+}
+
+/*
+ * Complete the requests of a poll queue that are due; return how many.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0))
+static int sbull_poll(struct blk_mq_hw_ctx *hctx)
+#else
+static int sbull_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+#endif
+{
+	struct sbull_queue *sq = hctx->driver_data;
+	struct sbull_cmd *cmd, *next;
+	u64 now = ktime_get_ns();
+	LIST_HEAD(due);
+	int found = 0;
+
+	spin_lock(&sq->lock);
+	list_for_each_entry_safe(cmd, next, &sq->done, list) {
+		if (cmd->deadline > now)
+			continue;
+		list_move_tail(&cmd->list, &due);
+		found++;
+	}
+	spin_unlock(&sq->lock);
+
+	list_for_each_entry_safe(cmd, next, &due, list) {
+		list_del_init(&cmd->list);
+		sbull_complete(blk_mq_rq_from_pdu(cmd));
+	}
+	return found;
+}
+#endif
+
 static struct blk_mq_ops mq_ops_simple = {
     .queue_rq = sbull_request,
+    .complete = sbull_complete,
+    .init_hctx = sbull_init_hctx,
+    .init_request = sbull_init_request,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+    .map_queues = sbull_map_queues,
+    .poll = sbull_poll,
+#endif
 };
 
 static struct blk_mq_ops mq_ops_full = {
     .queue_rq = sbull_full_request,
+    .complete = sbull_complete,
+    .init_hctx = sbull_init_hctx,
+    .init_request = sbull_init_request,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+    .map_queues = sbull_map_queues,
+    .poll = sbull_poll,
+#endif
 };
 
+/*
+ * A blk-mq queue with nr_hw_queues hardware queues (blk-mq maps the
+ * CPUs onto them) of queue_depth tags each, like null_blk, and
+ * poll_queues more for polled I/O, if asked for: blk-mq lets the
+ * queue be polled when the poll map isn't empty.
+ */
+static struct request_queue *sbull_init_mq(struct sbull_dev *dev,
+		struct blk_mq_ops *ops)
+{
+	struct request_queue *q;
+	int i, nr = nr_hw_queues + poll_queues;
+
+	dev->queues = kcalloc(nr, sizeof(*dev->queues), GFP_KERNEL);
+	if (!dev->queues)
+		return NULL;
+	for (i = 0; i < nr; i++) {
+		dev->queues[i].dev = dev;
+		spin_lock_init(&dev->queues[i].lock);
+		INIT_LIST_HEAD(&dev->queues[i].done);
+	}
+
+	dev->tag_set.ops = ops;
+	dev->tag_set.nr_hw_queues = nr;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+	dev->tag_set.nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+#endif
+	dev->tag_set.cmd_size = sizeof(struct sbull_cmd);
+	dev->tag_set.queue_depth = queue_depth;
+	dev->tag_set.numa_node = NUMA_NO_NODE;
+	dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+	dev->tag_set.driver_data = dev;
+	if (blk_mq_alloc_tag_set(&dev->tag_set))
+		goto out_free;
+	q = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(q)) {
+		blk_mq_free_tag_set(&dev->tag_set);
+		goto out_free;
+	}
+	/* a RAM disk: no seeks, and nothing random about its timing */
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+	return q;
+
+  out_free:
+	kfree(dev->queues);
+	dev->queues = NULL;
+	return NULL;
+}
+
 
 /*
  * Set up our internal device.
@@ -426,16 +1046,18 @@ static struct blk_mq_ops mq_ops_full = {
 static void setup_device(struct sbull_dev *dev, int which)
 {
 	/*
-	 * Get some memory.
+	 * No memory yet: pages come with the writes. The bio-based
+	 * version may sleep for them, blk-mq request functions may not.
 	 */
 	memset (dev, 0, sizeof (struct sbull_dev));
-	dev->size = nsectors*hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if (dev->data == NULL) {
-		printk (KERN_NOTICE "vmalloc failure.\n");
-		return;
-	}
+	dev->size = (u64)nsectors*hardsect_size;
+	xa_init(&dev->pages);
+	dev->gfp = request_mode == RM_NOQUEUE ? GFP_NOIO : GFP_NOWAIT;
 	spin_lock_init(&dev->lock);
+	spin_lock_init(&dev->busy_lock);
+	dev->latency_sigma = 500;	/* if lognormal: 0.5, a long tail */
+	if (completion_mode == SBULL_COMPLETE_TIMER)
+		dev->latency_ns = completion_nsec;
 	
 	/*
 	 * The timer which "invalidates" the device.
@@ -462,14 +1084,14 @@ static void setup_device(struct sbull_dev *dev, int which)
 		dev->queue =  blk_generic_alloc_queue(NUMA_NO_NODE);
 #endif
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 
 	    case RM_FULL:
 		//dev->queue = blk_init_queue(sbull_full_request, &dev->lock);
-		dev->queue = blk_mq_init_sq_queue(&dev->tag_set, &mq_ops_full, 128, BLK_MQ_F_SHOULD_MERGE);
+		dev->queue = sbull_init_mq(dev, &mq_ops_full);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 
 	    default:
@@ -478,34 +1100,47 @@ static void setup_device(struct sbull_dev *dev, int which)
 	
 	    case RM_SIMPLE:
 		//dev->queue = blk_init_queue(sbull_request, &dev->lock);
-		dev->queue = blk_mq_init_sq_queue(&dev->tag_set, &mq_ops_simple, 128, BLK_MQ_F_SHOULD_MERGE);
+		dev->queue = sbull_init_mq(dev, &mq_ops_simple);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 	}
 	blk_queue_logical_block_size(dev->queue, hardsect_size);
 	dev->queue->queuedata = dev;
+	/* discarding or zeroing whole pages gives them back */
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(dev->queue, UINT_MAX >> 9);
+	blk_queue_max_write_zeroes_sectors(dev->queue, UINT_MAX >> 9);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0))
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+#endif
 	/*
 	 * And the gendisk structure.
 	 */
 	dev->gd = alloc_disk(SBULL_MINORS);
 	if (! dev->gd) {
 		printk (KERN_NOTICE "alloc_disk failure\n");
-		goto out_vfree;
+		return;
 	}
 	dev->gd->major = sbull_major;
 	dev->gd->first_minor = which*SBULL_MINORS;
-	dev->gd->fops = &sbull_ops;
+	dev->gd->fops = request_mode == RM_NOQUEUE ? &sbull_bio_ops : &sbull_ops;
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
 	snprintf (dev->gd->disk_name, 32, "sbull%c", which + 'a');
-	set_capacity(dev->gd, nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
+	set_capacity(dev->gd, dev->size/KERNEL_SECTOR_SIZE);
+	/* the emulation only applies to requests: no knobs without them */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0))
+	device_add_disk(NULL, dev->gd,
+			request_mode == RM_NOQUEUE ? NULL : sbull_attr_groups);
+#else
 	add_disk(dev->gd);
-	return;
-
-  out_vfree:
-	if (dev->data)
-		vfree(dev->data);
+	if (request_mode != RM_NOQUEUE &&
+			sysfs_create_group(&disk_to_dev(dev->gd)->kobj,
+				&sbull_attr_group))
+		printk(KERN_WARNING "sbull: no sysfs knobs for %s\n",
+				dev->gd->disk_name);
+#endif
 }
 
 
@@ -521,6 +1156,20 @@ static int __init sbull_init(void)
 		printk(KERN_WARNING "sbull: unable to get major number\n");
 		return -EBUSY;
 	}
+	if (nr_hw_queues <= 0 || nr_hw_queues > nr_cpu_ids)
+		nr_hw_queues = nr_cpu_ids;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0))
+	poll_queues = 0; /* no queue types yet */
+#endif
+	if (poll_queues < 0)
+		poll_queues = 0;
+	if (poll_queues > nr_cpu_ids)
+		poll_queues = nr_cpu_ids;
+	if (queue_depth <= 0 || queue_depth > BLK_MQ_MAX_DEPTH) {
+		printk(KERN_WARNING "sbull: bad queue_depth %i, using 128\n",
+				queue_depth);
+		queue_depth = 128;
+	}
 	/*
 	 * Allocate the device array, and initialize each one.
 	 */
@@ -556,9 +1205,13 @@ static void sbull_exit(void)
 			else
 				blk_cleanup_queue(dev->queue);
 		}
-		if (dev->data)
-			vfree(dev->data);
+		if (dev->queues) {
+			blk_mq_free_tag_set(&dev->tag_set);
+			kfree(dev->queues);
+		}
+		sbull_free_pages(dev);
 	}
+	rcu_barrier(); /* the pages are freed by RCU callbacks */
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
 }
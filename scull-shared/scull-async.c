@@ -28,61 +28,221 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>	/* iov_iter* */
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/mutex.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include "scull.h"		/* the core methods */
+#include "scull-async.h"
+#include "async_version.h"
 
 
 /*
- * A simple asynchronous I/O implementation.
+ * A simple asynchronous I/O implementation for the front ends of
+ * scull. Requests that aren't synchronous (aio, io_uring) are queued
+ * to their device, and carried out by a work item on an unbound
+ * workqueue, one device at a time and in the order they came, through
+ * the read_iter and write_iter methods of the scull core. The work
+ * borrows the address space of the submitter, and completes whatever
+ * it found on the queue together once it's done. Only user buffers
+ * can be queued: kernel ones (like io_uring fixed buffers) may be
+ * gone by then, and get -EINVAL.
  */
 
 struct async_work {
-	struct delayed_work work;
+	struct llist_node node;
 	struct kiocb *iocb;
-	struct iov_iter *tofrom;
+	struct iov_iter tofrom;		/* our copy of the caller's */
+	const void *to_free;		/* and of its segments */
+	struct mm_struct *mm;		/* where they are */
+	ssize_t result;
 };
 
+struct async_queue {
+	struct llist_head reqs;
+	struct work_struct work;
+};
+
+static struct workqueue_struct *scull_async_wq;
+static DEFINE_XARRAY(scull_async_queues);	/* by device number */
+static DEFINE_MUTEX(scull_async_mutex);		/* for the setup */
+
+/*
+ * Run a queued request through the core, as a synchronous one that
+ * may block: the position and the append flag are those of the
+ * original.
+ */
+static ssize_t scull_do_rw(struct kiocb *iocb, struct iov_iter *tofrom)
+{
+	struct kiocb kiocb;
+	ssize_t retval;
+
+	init_sync_kiocb(&kiocb, iocb->ki_filp);
+	kiocb.ki_pos = iocb->ki_pos;
+	kiocb.ki_flags |= iocb->ki_flags & IOCB_APPEND;
+	if (iov_iter_rw(tofrom) == WRITE)
+		retval = scull_write_iter(&kiocb, tofrom);
+	else
+		retval = scull_read_iter(&kiocb, tofrom);
+	iocb->ki_pos = kiocb.ki_pos;
+	return retval;
+}
+
 /*
- * "Complete" an asynchronous operation.
+ * Carry out the queued operations, then complete them: the iocbs may
+ * be gone as soon as ki_complete is called.
  */
 static void scull_do_deferred_op(struct work_struct *work)
 {
-	struct async_work *stuff = container_of(work, struct async_work, work.work);
-	if( iov_iter_rw(stuff->tofrom) == WRITE ) {
-		generic_file_write_iter(stuff->iocb, stuff->tofrom);
-	} else {
-		generic_file_read_iter(stuff->iocb, stuff->tofrom);
+	struct async_queue *q = container_of(work, struct async_queue, work);
+	struct async_work *stuff, *next;
+	struct mm_struct *mm = NULL;
+	struct llist_node *list;
+
+	while ((list = llist_del_all(&q->reqs))) {
+		list = llist_reverse_order(list); /* oldest first */
+		llist_for_each_entry(stuff, list, node) {
+			if (stuff->mm != mm) {
+				if (mm) {
+					kthread_unuse_mm(mm);
+					mmput(mm);
+				}
+				mm = mmget_not_zero(stuff->mm) ? stuff->mm : NULL;
+				if (mm)
+					kthread_use_mm(mm);
+			}
+			if (!mm) { /* the process is exiting */
+				stuff->result = -EFAULT;
+				continue;
+			}
+			stuff->result = scull_do_rw(stuff->iocb, &stuff->tofrom);
+		}
+		if (mm) {
+			kthread_unuse_mm(mm);
+			mmput(mm);
+			mm = NULL;
+		}
+		llist_for_each_entry_safe(stuff, next, list, node) {
+			ki_complete_wrapper(stuff->iocb, stuff->result);
+			mmdrop(stuff->mm);
+			kfree(stuff->to_free);
+			kfree(stuff);
+		}
 	}
-	kfree(stuff);
 }
 
 
-static int scull_defer_op(struct kiocb *iocb, struct iov_iter *tofrom)
+static ssize_t scull_defer_op(struct kiocb *iocb, struct iov_iter *tofrom)
 {
+	gfp_t gfp = iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL;
+	struct async_queue *q;
 	struct async_work *stuff;
-	int result;
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
+
+	if (!user_backed_iter(tofrom))
+		return -EINVAL;
+	q = xa_load(&scull_async_queues, file_inode(iocb->ki_filp)->i_rdev);
+	if (!q) /* not opened through scull_async_open */
+		return -EINVAL;
+	stuff = kmalloc(sizeof(*stuff), gfp);
 	if (stuff == NULL)
-		return result; /* No memory, just complete now */
+		goto nomem;
+	/* the segments may be on the caller's stack */
+	stuff->tofrom = *tofrom;
+	stuff->to_free = NULL;
+	if (!iter_is_ubuf(tofrom)) {
+		stuff->to_free = dup_iter(&stuff->tofrom, tofrom, gfp);
+		if (!stuff->to_free) {
+			kfree(stuff);
+			goto nomem;
+		}
+	}
 	stuff->iocb = iocb;
-	INIT_DELAYED_WORK(&stuff->work, scull_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
+	stuff->mm = current->mm;
+	mmgrab(stuff->mm);
+	if (llist_add(&stuff->node, &q->reqs)) /* it was idle */
+		queue_work(scull_async_wq, &q->work);
 	return -EIOCBQUEUED;
+
+  nomem:
+	return iocb->ki_flags & IOCB_NOWAIT ? -EAGAIN : -ENOMEM;
 }
 
 
-ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+/*
+ * If this is a synchronous IOCB (readv), the core does it right away;
+ * it honours IOCB_NOWAIT itself.
+ */
+ssize_t scull_async_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb)) {
-		return generic_file_read_iter(iocb,to);
-	}
+	if (is_sync_kiocb(iocb))
+		return scull_read_iter(iocb, to);
 	return scull_defer_op(iocb, to);
 }
 
-ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+ssize_t scull_async_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	if (is_sync_kiocb(iocb)) {
-		return generic_file_write_iter(iocb,from);
-	}
+	if (is_sync_kiocb(iocb))
+		return scull_write_iter(iocb, from);
 	return scull_defer_op(iocb, from);
 }
+
+/*
+ * Make sure the device has a queue (and the module a workqueue), and
+ * tell io_uring it can submit to us directly: queueing never blocks,
+ * and neither do synchronous IOCB_NOWAIT calls.
+ */
+int scull_async_open(struct file *filp)
+{
+	dev_t devno = file_inode(filp)->i_rdev;
+	struct async_queue *q;
+	int retval = 0;
+
+	mutex_lock(&scull_async_mutex);
+	if (!scull_async_wq) {
+		scull_async_wq = alloc_workqueue("%s-async", WQ_UNBOUND, 0,
+				KBUILD_MODNAME);
+		if (!scull_async_wq) {
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+	if (xa_load(&scull_async_queues, devno))
+		goto out;
+	q = kmalloc(sizeof(*q), GFP_KERNEL);
+	if (!q) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	init_llist_head(&q->reqs);
+	INIT_WORK(&q->work, scull_do_deferred_op);
+	retval = xa_err(xa_store(&scull_async_queues, devno, q, GFP_KERNEL));
+	if (retval)
+		kfree(q);
+  out:
+	mutex_unlock(&scull_async_mutex);
+#ifdef FMODE_NOWAIT
+	if (!retval)
+		filp->f_mode |= FMODE_NOWAIT;
+#endif
+	return retval;
+}
+
+/*
+ * Nothing can be queued any more: each request holds a reference to
+ * its file, and hence to the module.
+ */
+void scull_async_cleanup(void)
+{
+	struct async_queue *q;
+	unsigned long index;
+
+	xa_for_each(&scull_async_queues, index, q) {
+		flush_work(&q->work);
+		kfree(q);
+	}
+	xa_destroy(&scull_async_queues);
+	if (scull_async_wq)
+		destroy_workqueue(scull_async_wq);
+}
@@ -18,8 +18,13 @@
 #define SCULL_SHARED_SCULL_ASYNC_H_
 
 
-ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
-ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+/* The read_iter and write_iter methods of the front ends of scull */
+ssize_t scull_async_write_iter(struct kiocb *iocb, struct iov_iter *from);
+ssize_t scull_async_read_iter(struct kiocb *iocb, struct iov_iter *to);
+
+/* Called by the open method, and at module unload */
+int scull_async_open(struct file *filp);
+void scull_async_cleanup(void);
 
 
 #endif /* SCULL_SHARED_SCULL_ASYNC_H_ */
@@ -81,8 +81,10 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =     	scull_llseek,
-	.read =       	scull_read,
-	.write =      	scull_write,
+	.read_iter =	scull_read_iter,
+	.write_iter =	scull_write_iter,
+	.splice_read =	scull_splice_read,
+	.splice_write =	iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -143,8 +145,10 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -216,8 +220,10 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
@@ -263,8 +269,7 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&lptr->device.lock);
+	scull_dev_init(&(lptr->device), NULL); /* initialize it */
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -315,8 +320,10 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -348,9 +355,7 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	int err;
 
 	/* Initialize the device structure */
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	mutex_init(&dev->lock);
+	scull_dev_init(dev, NULL);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -398,12 +403,14 @@ void scull_access_cleanup(void)
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
 		cdev_del(&dev->cdev);
 		scull_trim(scull_access_devs[i].sculldev);
+		scull_alloc_release(scull_access_devs[i].sculldev);
 	}
 
     	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
 		scull_trim(&(lptr->device));
+		scull_alloc_release(&(lptr->device));
 		kfree(lptr);
 	}
 
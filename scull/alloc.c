@@ -0,0 +1,649 @@
+/*
+ * alloc.c -- where scull quanta come from
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc(), kmem_cache */
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/nodemask.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "scull.h"		/* local definitions */
+#include "shrinker_version.h"
+
+/*
+ * The book shows the same device four more times (scullc, scullp,
+ * scullv, sculld), changing only the way a quantum is allocated.
+ * Here the choice is a table of methods instead, picked per device
+ * with "scull_alloc" at load time (a comma-separated list, one name
+ * per device; the last one applies to the remaining devices) or with
+ * SCULL_IOCSALLOC later.
+ *
+ * Methods may need some state, built on the first allocation (when
+ * the quantum is known) and kept until the quantum changes.
+ *
+ * Which NUMA node a quantum goes to is decided here too, once for all
+ * methods (see scull_quantum_node): they only pass the node on.
+ */
+
+int scull_arena = 16;	/* megabytes preallocated by the "arena" method */
+int scull_numa = SCULL_NUMA_LOCAL;	/* placement policy of new devices */
+int scull_node = 0;	/* node for SCULL_NUMA_BIND and _INTERLEAVE */
+module_param(scull_arena, int, S_IRUGO);
+module_param(scull_numa, int, S_IRUGO);
+module_param(scull_node, int, S_IRUGO);
+
+static atomic_t scull_caches = ATOMIC_INIT(0);
+
+/*
+ * "kmalloc": what scull always did for odd-sized quanta.
+ */
+static void *scull_kmalloc_alloc(struct scull_dev *dev, int nid, gfp_t gfp)
+{
+	return kmalloc_node(dev->quantum, gfp, nid);
+}
+
+static void scull_kmalloc_free(struct scull_dev *dev, void *quantum)
+{
+	kfree(quantum);
+}
+
+/*
+ * "cache": a slab cache per device, sized to the quantum (as scullc).
+ *
+ * Quanta freed by a trim are kept for the next writes, up to
+ * scull_pool_max per device, in a stack per node linked through the
+ * quanta themselves. The pool is per device, not one per node for
+ * all, because a quantum has to go back to the cache it came from,
+ * and each cache has the quantum size of its device. The shrinker
+ * walks all of the pools, and takes quanta back under memory pressure
+ * without the device lock, so each pool has its own.
+ */
+unsigned int scull_pool_max = 1024;	/* free quanta kept by each device */
+module_param(scull_pool_max, uint, S_IRUGO | S_IWUSR);
+
+struct scull_cache {
+	struct kmem_cache *cache;
+	struct list_head list;		/* in scull_cache_list */
+	spinlock_t lock;
+	unsigned long count;		/* quanta in the pool, all nodes */
+	struct scull_cache_node {
+		void *head;
+		unsigned long count;
+	} node[];
+};
+
+static LIST_HEAD(scull_cache_list);
+static DEFINE_SPINLOCK(scull_cache_lock);	/* protects the list */
+static struct shrinker *scull_cache_shrinker;
+
+static void *scull_cache_setup(struct scull_dev *dev)
+{
+	struct scull_cache *c;
+	char name[16];
+
+	c = kzalloc(struct_size(c, node, nr_node_ids), GFP_KERNEL);
+	if (!c)
+		return NULL;
+	snprintf(name, sizeof(name), "scull%i",
+			atomic_inc_return(&scull_caches));
+	c->cache = kmem_cache_create(name, dev->quantum, 0,
+			SLAB_HWCACHE_ALIGN, NULL);
+	if (!c->cache) {
+		kfree(c);
+		return NULL;
+	}
+	spin_lock_init(&c->lock);
+	spin_lock(&scull_cache_lock);
+	list_add(&c->list, &scull_cache_list);
+	spin_unlock(&scull_cache_lock);
+	return c;
+}
+
+/* Give back up to "nr" pooled quanta of node "nid" to the cache */
+static unsigned long scull_cache_drain(struct scull_cache *c, int nid,
+		unsigned long nr)
+{
+	unsigned long freed = 0;
+	void **quantum;
+
+	spin_lock(&c->lock);
+	while (freed < nr && (quantum = c->node[nid].head)) {
+		c->node[nid].head = *quantum;
+		c->node[nid].count--;
+		c->count--;
+		kmem_cache_free(c->cache, quantum);
+		freed++;
+	}
+	spin_unlock(&c->lock);
+	return freed;
+}
+
+static void scull_cache_release(struct scull_dev *dev)
+{
+	struct scull_cache *c = dev->alloc_priv;
+	int nid;
+
+	spin_lock(&scull_cache_lock); /* the shrinker is done with it */
+	list_del(&c->list);
+	spin_unlock(&scull_cache_lock);
+	for (nid = 0; nid < nr_node_ids; nid++)
+		scull_cache_drain(c, nid, ULONG_MAX);
+	kmem_cache_destroy(c->cache);
+	kfree(c);
+}
+
+static void *scull_cache_alloc(struct scull_dev *dev, int nid, gfp_t gfp)
+{
+	struct scull_cache *c = dev->alloc_priv;
+	void **quantum = NULL;
+	int n = nid == NUMA_NO_NODE ? numa_node_id() : nid;
+
+	/* only quanta on the node asked for are reused */
+	if (READ_ONCE(c->node[n].count)) {
+		spin_lock(&c->lock);
+		quantum = c->node[n].head;
+		if (quantum) {
+			c->node[n].head = *quantum;
+			c->node[n].count--;
+			c->count--;
+		}
+		spin_unlock(&c->lock);
+	}
+	if (!quantum)
+		return kmem_cache_alloc_node(c->cache, gfp, nid);
+	if (gfp & __GFP_ZERO)
+		memset(quantum, 0, dev->quantum);
+	return quantum;
+}
+
+static void scull_cache_free(struct scull_dev *dev, void *quantum)
+{
+	struct scull_cache *c = dev->alloc_priv;
+	int nid = page_to_nid(virt_to_page(quantum));
+
+	spin_lock(&c->lock);
+	if (c->count >= READ_ONCE(scull_pool_max)) {
+		spin_unlock(&c->lock);
+		kmem_cache_free(c->cache, quantum);
+		return;
+	}
+	*(void **)quantum = c->node[nid].head;
+	c->node[nid].head = quantum;
+	c->node[nid].count++;
+	c->count++;
+	spin_unlock(&c->lock);
+}
+
+static unsigned long scull_cache_count(struct shrinker *s,
+		struct shrink_control *sc)
+{
+	struct scull_cache *c;
+	unsigned long count = 0;
+
+	spin_lock(&scull_cache_lock);
+	list_for_each_entry(c, &scull_cache_list, list)
+		count += READ_ONCE(c->node[sc->nid].count);
+	spin_unlock(&scull_cache_lock);
+	return count;
+}
+
+static unsigned long scull_cache_scan(struct shrinker *s,
+		struct shrink_control *sc)
+{
+	struct scull_cache *c;
+	unsigned long freed = 0;
+
+	spin_lock(&scull_cache_lock);
+	list_for_each_entry(c, &scull_cache_list, list) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		freed += scull_cache_drain(c, sc->nid, sc->nr_to_scan - freed);
+	}
+	spin_unlock(&scull_cache_lock);
+	return freed ? freed : SHRINK_STOP;
+}
+
+/*
+ * "pages": compound pages from the page allocator (as scullp). This is
+ * the default, as quanta made of pages can be mapped or spliced: the
+ * reference taken on any page within a quantum is accounted to the
+ * whole of it.
+ *
+ * High orders may fail when memory is fragmented. Rather than failing
+ * the write, the quantum is then vmalloc()ed: made of single pages,
+ * each refcounted on its own, it can still be mapped and spliced, only
+ * not with huge pages.
+ */
+static void *scull_pages_alloc(struct scull_dev *dev, int nid, gfp_t gfp)
+{
+	int order = get_order(dev->quantum);
+	struct page *page;
+
+	/* don't try too hard for high orders: there's a fallback */
+	if (order)
+		gfp |= __GFP_NORETRY | __GFP_NOWARN;
+	page = alloc_pages_node(nid, gfp | __GFP_COMP, order);
+	if (page)
+		return page_address(page);
+	if (!order)
+		return NULL;
+	if (nid == NUMA_NO_NODE)
+		return vzalloc(dev->quantum);
+	return vzalloc_node(dev->quantum, nid);
+}
+
+static void scull_pages_free(struct scull_dev *dev, void *quantum)
+{
+	if (is_vmalloc_addr(quantum))
+		vfree(quantum);
+	else
+		__free_pages(virt_to_page(quantum), get_order(dev->quantum));
+}
+
+/*
+ * "vmalloc": virtually contiguous memory (as scullv).
+ */
+static void *scull_vmalloc_alloc(struct scull_dev *dev, int nid, gfp_t gfp)
+{
+	if (nid == NUMA_NO_NODE)
+		return vzalloc(dev->quantum);
+	return vzalloc_node(dev->quantum, nid);
+}
+
+static void scull_vmalloc_free(struct scull_dev *dev, void *quantum)
+{
+	vfree(quantum);
+}
+
+/*
+ * "arena": "scull_arena" megabytes allocated at once, cut in quanta
+ * kept on a stack. Getting a quantum is cheap and never sleeps, but
+ * when the arena is exhausted the device is full. The arena is where
+ * it was put when set up, so the NUMA policy has no say here.
+ */
+struct scull_arena {
+	spinlock_t lock;
+	void *base;
+	unsigned long nfree;
+	void *free[];		/* stack of free quanta */
+};
+
+static void *scull_arena_setup(struct scull_dev *dev)
+{
+	unsigned long stride = ALIGN(dev->quantum, SMP_CACHE_BYTES);
+	unsigned long i, n = ((unsigned long)scull_arena << 20) / stride;
+	struct scull_arena *arena;
+
+	if (!n)
+		return NULL;
+	arena = kvmalloc(struct_size(arena, free, n), GFP_KERNEL);
+	if (!arena)
+		return NULL;
+	arena->base = vmalloc(n * stride);
+	if (!arena->base) {
+		kvfree(arena);
+		return NULL;
+	}
+	spin_lock_init(&arena->lock);
+	/* lowest addresses on top, so that a fresh device is sequential */
+	for (i = 0; i < n; i++)
+		arena->free[i] = arena->base + (n - 1 - i) * stride;
+	arena->nfree = n;
+	return arena;
+}
+
+static void scull_arena_release(struct scull_dev *dev)
+{
+	struct scull_arena *arena = dev->alloc_priv;
+
+	vfree(arena->base);
+	kvfree(arena);
+}
+
+static void *scull_arena_alloc(struct scull_dev *dev, int nid, gfp_t gfp)
+{
+	struct scull_arena *arena = dev->alloc_priv;
+	void *quantum = NULL;
+
+	spin_lock(&arena->lock);
+	if (arena->nfree)
+		quantum = arena->free[--arena->nfree];
+	spin_unlock(&arena->lock);
+	if (quantum && (gfp & __GFP_ZERO))
+		memset(quantum, 0, dev->quantum);
+	return quantum;
+}
+
+static void scull_arena_free(struct scull_dev *dev, void *quantum)
+{
+	struct scull_arena *arena = dev->alloc_priv;
+
+	spin_lock(&arena->lock);
+	arena->free[arena->nfree++] = quantum;
+	spin_unlock(&arena->lock);
+}
+
+static const struct scull_allocator scull_allocators[] = {
+	{
+		.name =    "pages",	/* the default: must be first */
+		.pages =   1,
+		.compound = 1,
+		.alloc =   scull_pages_alloc,
+		.free =    scull_pages_free,
+	}, {
+		.name =    "kmalloc",
+		.alloc =   scull_kmalloc_alloc,
+		.free =    scull_kmalloc_free,
+	}, {
+		.name =    "cache",
+		.setup =   scull_cache_setup,
+		.release = scull_cache_release,
+		.alloc =   scull_cache_alloc,
+		.free =    scull_cache_free,
+	}, {
+		.name =    "vmalloc",
+		.pages =   1,
+		.alloc =   scull_vmalloc_alloc,
+		.free =    scull_vmalloc_free,
+	}, {
+		.name =    "arena",
+		.setup =   scull_arena_setup,
+		.release = scull_arena_release,
+		.alloc =   scull_arena_alloc,
+		.free =    scull_arena_free,
+	},
+};
+
+const struct scull_allocator *scull_alloc_default = scull_allocators;
+
+/*
+ * Look up a method by name; "len" is the length of the name, which
+ * may be part of a longer string.
+ */
+static const struct scull_allocator *scull_alloc_lookup(const char *name,
+		size_t len)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(scull_allocators); i++)
+		if (strlen(scull_allocators[i].name) == len &&
+				!strncmp(scull_allocators[i].name, name, len))
+			return scull_allocators + i;
+	return NULL;
+}
+
+/*
+ * The method for device number "n" in the comma-separated "list".
+ */
+const struct scull_allocator *scull_alloc_pick(const char *list, int n)
+{
+	const char *end;
+
+	if (!list || !*list)
+		return scull_alloc_default;
+	while ((end = strchr(list, ',')) && n--)
+		list = end + 1;
+	return scull_alloc_lookup(list, end ? end - list : strlen(list));
+}
+EXPORT_SYMBOL(scull_alloc_pick);
+
+/*
+ * NUMA placement. The node of a new quantum comes from the device
+ * policy; NUMA_NO_NODE leaves it to the method, which then takes the
+ * node of the writing process. Writers allocate in parallel, so two
+ * of them may get the same node when interleaving: it's a spread of
+ * the quanta, not a strict rotation.
+ */
+int scull_numa_check(int policy, int node)
+{
+	if (policy == SCULL_NUMA_LOCAL)
+		return 0;
+	if (policy != SCULL_NUMA_INTERLEAVE && policy != SCULL_NUMA_BIND)
+		return -EINVAL;
+	if (node < 0 || node >= nr_node_ids || !node_state(node, N_MEMORY))
+		return -EINVAL;
+	return 0;
+}
+
+static int scull_quantum_node(struct scull_dev *dev, gfp_t *gfp)
+{
+	int nid;
+
+	switch (dev->numa_policy) {
+	case SCULL_NUMA_INTERLEAVE:
+		nid = next_node_in(READ_ONCE(dev->numa_node),
+				node_states[N_MEMORY]);
+		WRITE_ONCE(dev->numa_node, nid);
+		return nid;
+	case SCULL_NUMA_BIND:
+		*gfp |= __GFP_THISNODE;
+		return dev->numa_node;
+	}
+	return NUMA_NO_NODE;
+}
+
+/* The node a quantum ended up on, whatever the method */
+static int scull_quantum_nid(void *quantum)
+{
+	if (is_vmalloc_addr(quantum))
+		return page_to_nid(vmalloc_to_page(quantum));
+	return page_to_nid(virt_to_page(quantum));
+}
+
+/*
+ * Get a new quantum, and account for the time it took and where it is.
+ * It comes cleared: holes read as zeros, and a mapping shows nothing
+ * that was there before.
+ */
+void *scull_new_quantum(struct scull_dev *dev)
+{
+	const struct scull_allocator *a = dev->alloc;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+	void *quantum;
+	int nid;
+	u64 t;
+
+	if (!smp_load_acquire(&dev->node_quanta)) {
+		mutex_lock(&dev->alloc_lock);
+		if (!dev->node_quanta) /* just statistics: ignore failures */
+			smp_store_release(&dev->node_quanta,
+					kcalloc(nr_node_ids, sizeof(atomic_long_t),
+						GFP_KERNEL));
+		mutex_unlock(&dev->alloc_lock);
+	}
+
+	if (a->setup && !smp_load_acquire(&dev->alloc_priv)) {
+		mutex_lock(&dev->alloc_lock);
+		if (!dev->alloc_priv)
+			smp_store_release(&dev->alloc_priv, a->setup(dev));
+		mutex_unlock(&dev->alloc_lock);
+		if (!dev->alloc_priv) {
+			atomic_long_inc(&dev->alloc_failed);
+			return NULL;
+		}
+	}
+
+	nid = scull_quantum_node(dev, &gfp);
+	t = ktime_get_ns();
+	quantum = a->alloc(dev, nid, gfp);
+	t = ktime_get_ns() - t;
+	if (!quantum) {
+		atomic_long_inc(&dev->alloc_failed);
+		return NULL;
+	}
+	atomic_long_inc(&dev->alloc_hist[min_t(int, fls64(t),
+			SCULL_HIST_BUCKETS - 1)]);
+	if (dev->node_quanta)
+		atomic_long_inc(&dev->node_quanta[scull_quantum_nid(quantum)]);
+	return quantum;
+}
+
+void scull_free_quantum(struct scull_dev *dev, void *quantum)
+{
+	if (!quantum)
+		return;
+	if (dev->node_quanta)
+		atomic_long_dec(&dev->node_quanta[scull_quantum_nid(quantum)]);
+	dev->alloc->free(dev, quantum);
+}
+
+/*
+ * Drop the state of the allocation method; the device must be empty.
+ */
+void scull_alloc_release(struct scull_dev *dev)
+{
+	if (dev->alloc->release && dev->alloc_priv)
+		dev->alloc->release(dev);
+	dev->alloc_priv = NULL;
+	kfree(dev->node_quanta);
+	dev->node_quanta = NULL;
+}
+EXPORT_SYMBOL(scull_alloc_release);
+
+/*
+ * Called by scull_trim once all quanta are gone: statistics start
+ * over, and the state is rebuilt if the quantum is going to change.
+ */
+void scull_alloc_trim(struct scull_dev *dev)
+{
+	int i;
+
+	if (dev->quantum != scull_default_quantum(dev))
+		scull_alloc_release(dev);
+	for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+		atomic_long_set(&dev->alloc_hist[i], 0);
+	atomic_long_set(&dev->alloc_failed, 0);
+}
+
+/*
+ * SCULL_IOCSALLOC, SCULL_IOCGALLOCSTAT and the NUMA ones, for every
+ * device built on scull_dev: the bare ones, the access-controlled ones
+ * and the scullc, scullp, scullv and sculld front ends.
+ */
+long scull_alloc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_dev *dev = filp->private_data;
+	const struct scull_allocator *a;
+	struct scull_alloc_stat *stat;
+	char name[SCULL_ALLOC_NAMELEN];
+	struct scull_numa numa;
+	int i, retval;
+
+	if (cmd == SCULL_IOCSNUMA) {
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (scull_numa_check(numa.policy, numa.node))
+			return -EINVAL;
+		/* writers see both at once */
+		if (down_write_killable(&dev->sem))
+			return -ERESTARTSYS;
+		dev->numa_policy = numa.policy;
+		dev->numa_node = numa.node;
+		up_write(&dev->sem);
+		return 0;
+	}
+	if (cmd == SCULL_IOCGNUMA) {
+		numa.policy = dev->numa_policy;
+		numa.node = READ_ONCE(dev->numa_node);
+		return copy_to_user((void __user *)arg, &numa, sizeof(numa)) ?
+			-EFAULT : 0;
+	}
+
+	if (cmd == SCULL_IOCSALLOC) {
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(name, (void __user *)arg, sizeof(name)))
+			return -EFAULT;
+		a = scull_alloc_lookup(name, strnlen(name, sizeof(name)));
+		if (!a)
+			return -EINVAL;
+		if (down_write_killable(&dev->sem))
+			return -ERESTARTSYS;
+		retval = scull_trim(dev); /* the device is emptied */
+		if (retval == 0) {
+			scull_alloc_release(dev);
+			dev->alloc = a;
+		}
+		up_write(&dev->sem);
+		return retval;
+	}
+
+	if (cmd != SCULL_IOCGALLOCSTAT)
+		return -ENOTTY;
+	stat = kzalloc(sizeof(*stat), GFP_KERNEL);
+	if (!stat)
+		return -ENOMEM;
+	strscpy(stat->name, dev->alloc->name, sizeof(stat->name));
+	for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+		stat->hist[i] = atomic_long_read(&dev->alloc_hist[i]);
+	stat->failed = atomic_long_read(&dev->alloc_failed);
+	retval = copy_to_user((void __user *)arg, stat, sizeof(*stat)) ?
+		-EFAULT : 0;
+	kfree(stat);
+	return retval;
+}
+EXPORT_SYMBOL(scull_alloc_ioctl);
+
+/* For /proc/scullmem: where the quanta are */
+void scull_alloc_show(struct seq_file *s, struct scull_dev *dev)
+{
+	struct scull_cache *c;
+	long n;
+	int nid;
+
+	if (dev->alloc->free == scull_cache_free && dev->alloc_priv) {
+		c = dev->alloc_priv;
+		seq_printf(s, "  pool: %lu free quanta\n", READ_ONCE(c->count));
+	}
+	if (!dev->node_quanta)
+		return;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		n = atomic_long_read(&dev->node_quanta[nid]);
+		if (n)
+			seq_printf(s, "  node %i: %li quanta\n", nid, n);
+	}
+}
+EXPORT_SYMBOL(scull_alloc_show);
+
+/*
+ * The shrinker for the pools of the "cache" method. They work without
+ * it, just aren't reclaimed: so failing to get one is no failure.
+ */
+void scull_alloc_init(void)
+{
+	scull_cache_shrinker = shrinker_alloc_wrapper(SHRINKER_NUMA_AWARE,
+			"scull", scull_cache_count, scull_cache_scan);
+	if (!scull_cache_shrinker)
+		printk(KERN_WARNING "scull: no shrinker, pools won't be reclaimed\n");
+}
+
+void scull_alloc_cleanup(void)
+{
+	shrinker_free_wrapper(scull_cache_shrinker);
+	scull_cache_shrinker = NULL;
+}
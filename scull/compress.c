@@ -0,0 +1,289 @@
+/*
+ * compress.c -- compression of cold scull quanta
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>
+#include <linux/mm.h>		/* is_vmalloc_addr() */
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+#include <crypto/acompress.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * With "scull_compress" set to a number of seconds, the quanta of the
+ * indexed devices (scull_xarray=1) that haven't been touched for that
+ * long are compressed in the background. Every access marks its
+ * quantum as hot; each pass of the work clears the marks it finds and
+ * compresses the quanta that were not marked, so a quantum is cold
+ * after one to two periods without I/O.
+ *
+ * A compressed quantum is stored in the xarray as a tagged pointer to
+ * a struct scull_zquantum, and decompressed back in place (under the
+ * qset lock, taken for writing) by the first access. Quanta that don't
+ * shrink by at least an eighth are marked and left alone until they
+ * are written again. Quanta that are mapped, shared (see dedup.c) or
+ * not in the kernel's direct mapping (the "vmalloc" and "arena"
+ * methods), aren't touched.
+ */
+
+int scull_compress = 0;		/* seconds before a quantum is cold, 0: off */
+char *scull_compress_alg = "lz4";
+module_param(scull_compress, int, S_IRUGO);
+module_param(scull_compress_alg, charp, S_IRUGO);
+
+static struct crypto_acomp *scull_ztfm;
+
+struct scull_zquantum {
+	unsigned int len;	/* of the compressed data */
+	char data[];
+};
+
+/*
+ * Run the compressor (or decompressor) synchronously; "*dlen" is the
+ * room in "dst" on entry, and what was used on return.
+ */
+static int scull_zrun(void *src, unsigned int slen, void *dst,
+		unsigned int *dlen, int compress)
+{
+	struct scatterlist in, out;
+	struct acomp_req *req;
+	DECLARE_CRYPTO_WAIT(wait);
+	int err;
+
+	req = acomp_request_alloc(scull_ztfm);
+	if (!req)
+		return -ENOMEM;
+	sg_init_one(&in, src, slen);
+	sg_init_one(&out, dst, *dlen);
+	acomp_request_set_params(req, &in, &out, slen, *dlen);
+	acomp_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP,
+			crypto_req_done, &wait);
+	err = crypto_wait_req(compress ? crypto_acomp_compress(req) :
+			crypto_acomp_decompress(req), &wait);
+	*dlen = req->dlen;
+	acomp_request_free(req);
+	return err;
+}
+
+/*
+ * Compress quantum "index", using "buf" (a quantum long) as scratch
+ * space. The caller holds the qset lock for writing.
+ */
+static void scull_zip(struct scull_dev *dev, unsigned long index, void *buf)
+{
+	struct scull_zquantum *z;
+	unsigned int dlen = dev->quantum;
+	void *quantum = xa_load(&dev->quanta, index);
+
+	if (!quantum || xa_pointer_tag(quantum) || atomic_read(&dev->vmas) ||
+			xa_get_mark(&dev->quanta, index, SCULL_HOT))
+		return; /* gone, or touched while we waited for the lock */
+
+	if (scull_zrun(quantum, dev->quantum, buf, &dlen, 1) ||
+			dlen > dev->quantum - dev->quantum / 8) {
+		xa_set_mark(&dev->quanta, index, SCULL_NOZIP);
+		return;
+	}
+	z = kmalloc(sizeof(*z) + dlen, GFP_KERNEL);
+	if (!z)
+		return;
+	z->len = dlen;
+	memcpy(z->data, buf, dlen);
+	if (xa_err(xa_store(&dev->quanta, index,
+			xa_tag_pointer(z, SCULL_ZTAG), GFP_KERNEL))) {
+		kfree(z);
+		return;
+	}
+	scull_free_quantum(dev, quantum);
+	atomic_long_inc(&dev->zcount);
+	atomic_long_add(dlen, &dev->zbytes);
+}
+
+/*
+ * Decompress quantum "index" if needed, and return it; NULL if out of
+ * memory. The caller holds the qset lock for writing.
+ */
+void *scull_unzip(struct scull_dev *dev, unsigned long index)
+{
+	void *entry = xa_load(&dev->quanta, index), *quantum;
+	struct scull_zquantum *z;
+	unsigned int dlen = dev->quantum;
+	u64 t;
+
+	if (!scull_zipped(entry))
+		return entry;
+	z = xa_untag_pointer(entry);
+	quantum = scull_new_quantum(dev);
+	if (!quantum)
+		return NULL;
+
+	t = ktime_get_ns();
+	if (scull_zrun(z->data, z->len, quantum, &dlen, 0)) {
+		printk(KERN_WARNING "scull: can't decompress quantum %li\n",
+				index);
+		scull_free_quantum(dev, quantum);
+		return NULL;
+	}
+	atomic_long_add(ktime_get_ns() - t, &dev->unzip_ns);
+	atomic_long_inc(&dev->unzips);
+
+	xa_store(&dev->quanta, index, quantum, GFP_KERNEL); /* slot exists */
+	xa_set_mark(&dev->quanta, index, SCULL_HOT);
+	atomic_long_dec(&dev->zcount);
+	atomic_long_sub(z->len, &dev->zbytes);
+	kfree(z);
+	return quantum;
+}
+
+/*
+ * Same, for callers holding the qset lock for reading, which they
+ * still hold on return (but not all the time in between).
+ */
+void *scull_unzip_shared(struct scull_dev *dev, unsigned long index,
+		struct rw_semaphore *qlock)
+{
+	void *quantum;
+
+	up_read(qlock);
+	down_write(qlock);
+	quantum = scull_unzip(dev, index);
+	downgrade_write(qlock);
+	return quantum;
+}
+
+/* Free a quantum that may be compressed (trim only) */
+void scull_zfree(struct scull_dev *dev, void *entry)
+{
+	struct scull_zquantum *z;
+
+	if (!scull_zipped(entry)) {
+		scull_free_quantum(dev, entry);
+		return;
+	}
+	z = xa_untag_pointer(entry);
+	atomic_long_dec(&dev->zcount);
+	atomic_long_sub(z->len, &dev->zbytes);
+	kfree(z);
+}
+
+/*
+ * Mark quantum "index" as recently used; a write also makes it worth
+ * trying again if it didn't compress.
+ */
+void scull_touch(struct scull_dev *dev, unsigned long index, int write)
+{
+	if (!scull_ztfm)
+		return;
+	if (!xa_get_mark(&dev->quanta, index, SCULL_HOT))
+		xa_set_mark(&dev->quanta, index, SCULL_HOT);
+	if (write && xa_get_mark(&dev->quanta, index, SCULL_NOZIP))
+		xa_clear_mark(&dev->quanta, index, SCULL_NOZIP);
+}
+
+static void scull_zwork(struct work_struct *work)
+{
+	struct scull_dev *dev = container_of(to_delayed_work(work),
+			struct scull_dev, zwork);
+	struct rw_semaphore *qlock;
+	unsigned long index;
+	void *entry, *buf = NULL;
+
+	down_read(&dev->sem);
+	if (dev->indexed && !atomic_read(&dev->vmas))
+		buf = kmalloc(dev->quantum, GFP_KERNEL);
+	if (!buf)
+		goto out;
+	xa_for_each(&dev->quanta, index, entry) {
+		if (xa_get_mark(&dev->quanta, index, SCULL_HOT)) {
+			xa_clear_mark(&dev->quanta, index, SCULL_HOT);
+			continue;
+		}
+		if (xa_pointer_tag(entry) || is_vmalloc_addr(entry) ||
+				xa_get_mark(&dev->quanta, index, SCULL_NOZIP))
+			continue;
+		qlock = scull_qlock(dev, index);
+		down_write(qlock);
+		scull_zip(dev, index, buf);
+		up_write(qlock);
+		cond_resched();
+	}
+	kfree(buf);
+  out:
+	up_read(&dev->sem);
+	schedule_delayed_work(&dev->zwork, scull_compress * HZ);
+}
+
+/*
+ * Start (and stop) the work of one device.
+ */
+void scull_zip_start(struct scull_dev *dev)
+{
+	INIT_DELAYED_WORK(&dev->zwork, scull_zwork);
+	if (scull_ztfm)
+		schedule_delayed_work(&dev->zwork, scull_compress * HZ);
+}
+EXPORT_SYMBOL(scull_zip_start);
+
+void scull_zip_stop(struct scull_dev *dev)
+{
+	if (scull_ztfm)
+		cancel_delayed_work_sync(&dev->zwork);
+}
+EXPORT_SYMBOL(scull_zip_stop);
+
+void scull_zip_show(struct seq_file *s, struct scull_dev *dev)
+{
+	long count = atomic_long_read(&dev->zcount);
+	long bytes = atomic_long_read(&dev->zbytes);
+	long unzips = atomic_long_read(&dev->unzips);
+	long ratio = bytes ? count * dev->quantum * 100 / bytes : 0;
+
+	if (!scull_ztfm || !dev->indexed)
+		return;
+	seq_printf(s, "  %li quanta compressed in %li bytes, ratio %li.%02li;"
+			" %li decompressed, %li ns each\n", count, bytes,
+			ratio / 100, ratio % 100, unzips,
+			unzips ? atomic_long_read(&dev->unzip_ns) / unzips : 0);
+}
+
+void scull_zip_init(void)
+{
+	if (scull_compress <= 0)
+		return;
+	scull_ztfm = crypto_alloc_acomp(scull_compress_alg, 0, 0);
+	if (IS_ERR(scull_ztfm)) {
+		printk(KERN_WARNING "scull: no \"%s\" compression (%li),"
+				" quanta stay as they are\n",
+				scull_compress_alg, PTR_ERR(scull_ztfm));
+		scull_ztfm = NULL;
+	}
+}
+
+void scull_zip_cleanup(void)
+{
+	if (scull_ztfm)
+		crypto_free_acomp(scull_ztfm);
+}
@@ -0,0 +1,191 @@
+/*
+ * dedup.c -- sharing of identical scull quanta
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/string.h>	/* memchr_inv() */
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/hash.h>
+#include <linux/xxhash.h>
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * With "scull_dedup" set, every quantum of an indexed device is hashed
+ * when a write fills it up to its end. An all-zero quantum is freed,
+ * leaving a hole (holes read as zeros); otherwise, if an identical
+ * quantum is already in the device, the two are shared. A shared
+ * quantum is a struct scull_shared, stored as a tagged pointer in the
+ * xarray, and is copied by the first write to any of its users (or by
+ * a page fault, as mappings may write).
+ *
+ * The hash table of a device and the reference counts are protected
+ * by dedup_lock: a quantum is only written in place once it's out of
+ * the table, so that nobody can start sharing it meanwhile.
+ */
+
+int scull_dedup = 0;
+module_param(scull_dedup, int, S_IRUGO | S_IWUSR);
+
+#define SCULL_DEDUP_BITS 10
+
+/*
+ * Drop a reference to a shared quantum, freeing it with the last one.
+ * Called with dedup_lock held, or by trim.
+ */
+static void scull_put_shared(struct scull_dev *dev, struct scull_shared *s)
+{
+	if (--s->count) {
+		atomic_long_dec(&dev->dedup_saved);
+		return;
+	}
+	hlist_del(&s->hnode);
+	scull_free_quantum(dev, s->quantum);
+	kfree(s);
+}
+
+/*
+ * Hash quantum "index", just filled by a write, and share it if we
+ * can. The caller holds the qset lock for writing.
+ */
+void scull_dedup_quantum(struct scull_dev *dev, unsigned long index)
+{
+	void *quantum = xa_load(&dev->quanta, index);
+	struct hlist_head *bucket;
+	struct scull_shared *s;
+	u64 hash;
+
+	if (!quantum || xa_pointer_tag(quantum) || atomic_read(&dev->vmas))
+		return;
+
+	if (!memchr_inv(quantum, 0, dev->quantum)) {
+		xa_erase(&dev->quanta, index);
+		scull_free_quantum(dev, quantum);
+		atomic_long_inc(&dev->dedup_zero);
+		return;
+	}
+
+	hash = xxh64(quantum, dev->quantum, 0);
+	mutex_lock(&dev->dedup_lock);
+	atomic_long_inc(&dev->dedup_hashed);
+	if (!dev->dedup) {
+		dev->dedup = kcalloc(1 << SCULL_DEDUP_BITS,
+				sizeof(struct hlist_head), GFP_KERNEL);
+		if (!dev->dedup)
+			goto out;
+	}
+	bucket = dev->dedup + hash_64(hash, SCULL_DEDUP_BITS);
+	hlist_for_each_entry(s, bucket, hnode) {
+		if (s->hash != hash || memcmp(s->quantum, quantum, dev->quantum))
+			continue;
+		/* a hit: use this one and free ours */
+		xa_store(&dev->quanta, index, xa_tag_pointer(s, SCULL_STAG),
+				GFP_KERNEL); /* slot exists */
+		s->count++;
+		atomic_long_inc(&dev->dedup_hits);
+		atomic_long_inc(&dev->dedup_saved);
+		scull_free_quantum(dev, quantum);
+		goto out;
+	}
+
+	/* new contents: make it shareable by the next ones */
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		goto out;
+	s->hash = hash;
+	s->count = 1;
+	s->quantum = quantum;
+	if (xa_err(xa_store(&dev->quanta, index, xa_tag_pointer(s, SCULL_STAG),
+			GFP_KERNEL))) {
+		kfree(s);
+		goto out;
+	}
+	hlist_add_head(&s->hnode, bucket);
+  out:
+	mutex_unlock(&dev->dedup_lock);
+}
+
+/*
+ * Give quantum "index" a private copy if it's shared, and return it;
+ * NULL if out of memory. The caller holds the qset lock for writing.
+ */
+void *scull_unshare(struct scull_dev *dev, unsigned long index)
+{
+	void *entry = xa_load(&dev->quanta, index), *quantum;
+	struct scull_shared *s;
+
+	if (!scull_shared(entry))
+		return entry;
+	s = xa_untag_pointer(entry);
+
+	mutex_lock(&dev->dedup_lock);
+	if (s->count == 1) {
+		/* ours only: take the quantum back */
+		quantum = s->quantum;
+		hlist_del(&s->hnode);
+		kfree(s);
+	} else {
+		quantum = scull_new_quantum(dev);
+		if (!quantum)
+			goto out;
+		memcpy(quantum, s->quantum, dev->quantum);
+		scull_put_shared(dev, s);
+	}
+	xa_store(&dev->quanta, index, quantum, GFP_KERNEL); /* slot exists */
+  out:
+	mutex_unlock(&dev->dedup_lock);
+	return quantum;
+}
+
+/* Called by trim, for each shared quantum */
+void scull_dedup_free(struct scull_dev *dev, void *entry)
+{
+	scull_put_shared(dev, xa_untag_pointer(entry));
+}
+
+/* Called by trim, when the quanta are all gone */
+void scull_dedup_trim(struct scull_dev *dev)
+{
+	kfree(dev->dedup);
+	dev->dedup = NULL;
+	atomic_long_set(&dev->dedup_hashed, 0);
+	atomic_long_set(&dev->dedup_hits, 0);
+	atomic_long_set(&dev->dedup_zero, 0);
+	atomic_long_set(&dev->dedup_saved, 0);
+}
+
+void scull_dedup_show(struct seq_file *s, struct scull_dev *dev)
+{
+	long hashed = atomic_long_read(&dev->dedup_hashed);
+	long hits = atomic_long_read(&dev->dedup_hits);
+	long zero = atomic_long_read(&dev->dedup_zero);
+
+	if (!hashed && !zero)
+		return;
+	seq_printf(s, "  dedup: %li hashed, %li hits (%li%%), %li zero;"
+			" %li bytes saved\n", hashed, hits,
+			hashed ? hits * 100 / hashed : 0, zero,
+			(atomic_long_read(&dev->dedup_saved) + zero) *
+			dev->quantum);
+}
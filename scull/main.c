@@ -25,14 +25,24 @@
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
+#include <linux/falloc.h>	/* FALLOC_FL_* */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/overflow.h>	/* check_add_overflow() */
+#include <linux/huge_mm.h>	/* thp_get_unmapped_area() */
 
 #include <linux/uaccess.h>	/* copy_*_user */
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/pipe_fs_i.h>	/* pipe_buffer, add_to_pipe() */
 
 #include "scull.h"		/* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
+#include "splice_version.h"
+#include "uring_cmd_version.h"
+#include "fault_in_version.h"
 
 /*
  * Our parameters which can be set at load time.
@@ -43,21 +53,89 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_xarray =  0;	/* index quanta in an xarray instead of the list */
+char *scull_alloc =  NULL;	/* allocation method of each device */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_xarray, int, S_IRUGO | S_IWUSR); /* applies at next trim */
+module_param(scull_alloc, charp, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
+/*
+ * Free the quanta numbered "first" to "last" (inclusive) of an
+ * indexed device; must be called with the device semaphore held.
+ */
+static void scull_free_range(struct scull_dev *dev, unsigned long first,
+		unsigned long last)
+{
+	unsigned long index;
+	void *quantum;
+
+	xa_for_each_range(&dev->quanta, index, quantum, first, last) {
+		xa_erase(&dev->quanta, index);
+		if (scull_shared(quantum))
+			scull_dedup_free(dev, quantum);
+		else
+			scull_zfree(dev, quantum); /* it may be compressed */
+	}
+}
+
+static const struct scull_defaults scull_own_defaults = {
+	.quantum =  &scull_quantum,
+	.qset =     &scull_qset,
+};
+
+/*
+ * The quantum a trim gives back to a device. The ioctls of front ends
+ * counting in pages don't check the order they set.
+ */
+int scull_default_quantum(struct scull_dev *dev)
+{
+	const struct scull_defaults *d = dev->defaults;
+
+	if (d->order)
+		return PAGE_SIZE << clamp(READ_ONCE(*d->order), 0,
+				SCULL_MAX_ORDER);
+	return READ_ONCE(*d->quantum);
+}
+
+/*
+ * Initialize an empty device; its quantum and qset come from
+ * "defaults", or from our own parameters if it's NULL.
+ */
+void scull_dev_init(struct scull_dev *dev,
+		const struct scull_defaults *defaults)
+{
+	int i;
+
+	dev->defaults = defaults ? defaults : &scull_own_defaults;
+	dev->quantum = scull_default_quantum(dev);
+	dev->qset = READ_ONCE(*dev->defaults->qset);
+	dev->indexed = scull_xarray;
+	dev->alloc = scull_alloc_default;
+	dev->numa_policy = scull_numa;
+	dev->numa_node = scull_node;
+	init_rwsem(&dev->sem);
+	for (i = 0; i < SCULL_QLOCKS; i++)
+		init_rwsem(&dev->qlock[i]);
+	mutex_init(&dev->alloc_lock);
+	mutex_init(&dev->dedup_lock);
+	xa_init(&dev->quanta);
+	atomic_set(&dev->vmas, 0);
+}
+EXPORT_SYMBOL(scull_dev_init);
+
 /*
  * Empty out the scull device; must be called with the device
- * semaphore held.
+ * semaphore held for writing.
  */
 int scull_trim(struct scull_dev *dev)
 {
@@ -65,22 +143,33 @@ int scull_trim(struct scull_dev *dev)
 	int qset = dev->qset;   /* "dev" is not-null */
 	int i;
 
+	if (atomic_read(&dev->vmas)) /* don't trim: there are active mappings */
+		return -EBUSY;
+
+	if (dev->indexed) {
+		scull_free_range(dev, 0, ULONG_MAX);
+		xa_destroy(&dev->quanta);
+		scull_dedup_trim(dev);
+	}
 	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
+				scull_free_quantum(dev, dptr->data[i]);
 			kfree(dptr->data);
 			dptr->data = NULL;
 		}
 		next = dptr->next;
 		kfree(dptr);
 	}
+	scull_alloc_trim(dev);
 	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
+	dev->quantum = scull_default_quantum(dev);
+	dev->qset = READ_ONCE(*dev->defaults->qset);
+	dev->indexed = scull_xarray;
 	dev->data = NULL;
 	return 0;
 }
+EXPORT_SYMBOL(scull_trim);
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * The proc filesystem: function to read and entry
@@ -94,10 +183,23 @@ int scull_read_procmem(struct seq_file *s, void *v)
         for (i = 0; i < scull_nr_devs && s->count <= limit; i++) {
                 struct scull_dev *d = &scull_devices[i];
                 struct scull_qset *qs = d->data;
-                if (mutex_lock_interruptible(&d->lock))
+                if (down_read_killable(&d->sem))
                         return -ERESTARTSYS;
-                seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
-                             i, d->qset, d->quantum, d->size);
+                seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li, alloc %s\n",
+                             i, d->qset, d->quantum, d->size, d->alloc->name);
+                scull_alloc_show(s, d);
+                scull_zip_show(s, d);
+                scull_dedup_show(s, d);
+                if (d->indexed) {
+                        unsigned long index;
+                        void *quantum;
+
+                        xa_for_each(&d->quanta, index, quantum) {
+                                if (s->count > limit)
+                                        break;
+                                seq_printf(s, "    % 8li: %8p\n", index, quantum);
+                        }
+                }
                 for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
                         seq_printf(s, "  item at %p, qset at %p\n",
                                      qs, qs->data);
@@ -108,57 +210,192 @@ int scull_read_procmem(struct seq_file *s, void *v)
                                                              j, qs->data[j]);
                                 }
                 }
-                mutex_unlock(&scull_devices[i].lock);
+                up_read(&scull_devices[i].sem);
         }
         return 0;
 }
 
 /*
- * Here are our sequence iteration methods.  Our "position" is
- * simply the device number.
+ * Here are our sequence iteration methods. A record is either the
+ * header of a device or one of its quantum sets, so that even a huge
+ * device is printed a page at a time: the position holds the device
+ * number in its high bits, and the set in the low ones (0 for the
+ * header, then the set number plus one). The device semaphore is held
+ * from start to stop, and the set is looked up again by each start.
+ */
+#define SCULL_SEQ_SHIFT		40
+#define SCULL_SEQ_POS(i, set)	(((loff_t)(i) << SCULL_SEQ_SHIFT) | (set))
+
+struct scull_seq_iter {
+	struct scull_dev *dev;		/* the one locked, if any */
+	unsigned long set;		/* as in the position */
+	struct scull_qset *item;	/* the list item of the set */
+};
+
+/*
+ * Find the first set of it->dev from "set" on, skipping empty ones;
+ * NULL if there's none left.
  */
+static struct scull_seq_iter *scull_seq_find(struct scull_seq_iter *it,
+		unsigned long set)
+{
+	struct scull_dev *dev = it->dev;
+	unsigned long index, n;
+
+	if (set == 0)
+		goto found;
+	if (dev->indexed) {
+		index = (set - 1) * dev->qset;
+		if (!xa_find(&dev->quanta, &index, ULONG_MAX, XA_PRESENT))
+			return NULL;
+		set = index / dev->qset + 1;
+	} else {
+		if (it->item && it->set == set - 1) /* coming from next */
+			it->item = it->item->next;
+		else
+			for (it->item = dev->data, n = 1; it->item && n < set; n++)
+				it->item = it->item->next;
+		if (!it->item)
+			return NULL;
+	}
+  found:
+	it->set = set;
+	return it;
+}
+
 static void *scull_seq_start(struct seq_file *s, loff_t *pos)
 {
-	if (*pos >= scull_nr_devs)
-		return NULL;   /* No more to read */
-	return scull_devices + *pos;
+	struct scull_seq_iter *it = s->private;
+	int i = *pos >> SCULL_SEQ_SHIFT;
+	unsigned long set = *pos & ((1ULL << SCULL_SEQ_SHIFT) - 1);
+
+	for (; i < scull_nr_devs; i++, set = 0) {
+		it->dev = scull_devices + i;
+		it->item = NULL;
+		if (down_read_killable(&it->dev->sem)) {
+			it->dev = NULL;
+			return ERR_PTR(-ERESTARTSYS);
+		}
+		if (scull_seq_find(it, set)) {
+			*pos = SCULL_SEQ_POS(i, it->set);
+			return it;
+		}
+		up_read(&it->dev->sem);
+	}
+	it->dev = NULL;
+	return NULL;   /* No more to read */
 }
 
 static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
 {
-	(*pos)++;
-	if (*pos >= scull_nr_devs)
-		return NULL;
-	return scull_devices + *pos;
+	struct scull_seq_iter *it = v;
+	int i = it->dev - scull_devices;
+
+	if (scull_seq_find(it, it->set + 1)) {
+		*pos = SCULL_SEQ_POS(i, it->set);
+		return it;
+	}
+	/* on to the next device */
+	up_read(&it->dev->sem);
+	it->dev = NULL;
+	*pos = SCULL_SEQ_POS(i + 1, 0);
+	return scull_seq_start(s, pos);
 }
 
 static void scull_seq_stop(struct seq_file *s, void *v)
 {
-	/* Actually, there's nothing to do here */
+	struct scull_seq_iter *it = s->private;
+
+	if (it->dev)
+		up_read(&it->dev->sem);
+	it->dev = NULL;
+	it->item = NULL; /* it may be gone before we start again */
 }
 
 static int scull_seq_show(struct seq_file *s, void *v)
 {
-	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
+	struct scull_seq_iter *it = v;
+	struct scull_dev *dev = it->dev;
+	struct scull_qset *d = it->item;
+	unsigned long index, first, lo = 0, hi = 0;
+	void *quantum;
+	int i, n = 0;
+
+	if (it->set == 0) {
+		seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li, alloc %s\n",
+				(int) (dev - scull_devices), dev->qset,
+				dev->quantum, dev->size, dev->alloc->name);
+		scull_zip_show(s, dev);
+		scull_dedup_show(s, dev);
+		return 0;
+	}
+	/*
+	 * One line per set, not per quantum: with a thousand quanta in
+	 * a set, pointers would make this file tens of kilobytes a set.
+	 */
+	if (dev->indexed) {
+		first = (it->set - 1) * dev->qset;
+		xa_for_each_range(&dev->quanta, index, quantum, first,
+				first + dev->qset - 1) {
+			if (!n++)
+				lo = index;
+			hi = index;
+		}
+		seq_printf(s, "  set % 6li: %i quanta, %li-%li\n",
+				it->set - 1, n, lo, hi);
+		return 0;
+	}
+	seq_printf(s, "  item at %p, qset at %p", d, d->data);
+	if (d->data)
+		for (i = 0; i < dev->qset; i++) {
+			if (!d->data[i])
+				continue;
+			if (!n++)
+				lo = i;
+			hi = i;
+		}
+	if (n)
+		seq_printf(s, ": %i quanta, %li-%li", n, lo, hi);
+	seq_putc(s, '\n');
+	return 0;
+}
+
+/*
+ * /proc/scullstat: the counters of each device, as an array of
+ * struct scull_dev_stat, for tools that don't want to parse the above.
+ */
+static ssize_t scullstat_proc_read(struct file *filp, char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct scull_dev_stat *stat;
+	struct scull_dev *dev;
+	ssize_t retval;
 	int i;
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-			(int) (dev - scull_devices), dev->qset,
-			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
-			}
+	stat = kcalloc(scull_nr_devs, sizeof(*stat), GFP_KERNEL);
+	if (!stat)
+		return -ENOMEM;
+	for (i = 0; i < scull_nr_devs; i++) {
+		dev = scull_devices + i;
+		stat[i].qset = dev->qset;
+		stat[i].quantum = dev->quantum;
+		stat[i].size = dev->size;
+		stat[i].indexed = dev->indexed;
+		stat[i].vmas = atomic_read(&dev->vmas);
+		stat[i].alloc_failed = atomic_long_read(&dev->alloc_failed);
+		stat[i].zcount = atomic_long_read(&dev->zcount);
+		stat[i].zbytes = atomic_long_read(&dev->zbytes);
+		stat[i].unzips = atomic_long_read(&dev->unzips);
+		stat[i].unzip_ns = atomic_long_read(&dev->unzip_ns);
+		stat[i].dedup_hashed = atomic_long_read(&dev->dedup_hashed);
+		stat[i].dedup_hits = atomic_long_read(&dev->dedup_hits);
+		stat[i].dedup_zero = atomic_long_read(&dev->dedup_zero);
+		stat[i].dedup_saved = atomic_long_read(&dev->dedup_saved);
 	}
-	mutex_unlock(&dev->lock);
-	return 0;
+	retval = simple_read_from_buffer(buf, count, f_pos, stat,
+			scull_nr_devs * sizeof(*stat));
+	kfree(stat);
+	return retval;
 }
 	
 /*
@@ -182,7 +419,8 @@ static int scullmem_proc_open(struct inode *inode, struct file *file)
 
 static int scullseq_proc_open(struct inode *inode, struct file *file)
 {
-	return seq_open(file, &scull_seq_ops);
+	return seq_open_private(file, &scull_seq_ops,
+			sizeof(struct scull_seq_iter));
 }
 
 /*
@@ -201,7 +439,13 @@ static struct file_operations scullseq_proc_ops = {
 	.open    = scullseq_proc_open,
 	.read    = seq_read,
 	.llseek  = seq_lseek,
-	.release = seq_release
+	.release = seq_release_private
+};
+
+static struct file_operations scullstat_proc_ops = {
+	.owner   = THIS_MODULE,
+	.read    = scullstat_proc_read,
+	.llseek  = default_llseek,
 };
 	
 
@@ -215,6 +459,7 @@ static void scull_create_proc(void)
 			NULL /* parent dir */, proc_ops_wrapper(&scullmem_proc_ops, scullmem_pops),
 			NULL /* client data */);
 	proc_create("scullseq", 0, NULL, proc_ops_wrapper(&scullseq_proc_ops, scullseq_pops));
+	proc_create("scullstat", 0, NULL, proc_ops_wrapper(&scullstat_proc_ops, scullstat_pops));
 }
 
 static void scull_remove_proc(void)
@@ -222,6 +467,7 @@ static void scull_remove_proc(void)
 	/* no problem if it was not registered */
 	remove_proc_entry("scullmem", NULL /* parent dir */);
 	remove_proc_entry("scullseq", NULL);
+	remove_proc_entry("scullstat", NULL);
 }
 
 
@@ -241,43 +487,52 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
 	filp->private_data = dev; /* for other methods */
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT; /* read_iter and write_iter honour it */
+#endif
 
 	/* now trim(修剪；修整) to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->lock))
+		if (down_write_killable(&dev->sem))
 			return -ERESTARTSYS;
 		scull_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->lock);
+		up_write(&dev->sem);
 	}
 	return 0;          /* success */
 }
+EXPORT_SYMBOL(scull_open);
 
 int scull_release(struct inode *inode, struct file *filp)
 {
 	return 0;
 }
+EXPORT_SYMBOL(scull_release);
 /*
- * Follow the list
+ * Follow the list; must be called with alloc_lock held. New items
+ * are published with release semantics, as readers walk the list
+ * without that lock.
  */
 struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 {
-	struct scull_qset *qs = dev->data;
+	struct scull_qset *qs = dev->data, *new;
 
         /* Allocate first qset explicitly if need be */
 	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+		qs = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
 		if (qs == NULL)
 			return NULL;  /* Never mind */
 		memset(qs, 0, sizeof(struct scull_qset));
+		smp_store_release(&dev->data, qs);
 	}
 
 	/* Then follow the list */
 	while (n--) {
 		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
+			new = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+			if (new == NULL)
 				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
+			memset(new, 0, sizeof(struct scull_qset));
+			smp_store_release(&qs->next, new);
 		}
 		qs = qs->next;
 		continue;
@@ -286,105 +541,420 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 }
 
 /*
- * Data management: read and write
+ * The per-qset lock covering quantum number "index".
  */
+struct rw_semaphore *scull_qlock(struct scull_dev *dev,
+		unsigned long index)
+{
+	return &dev->qlock[(index / dev->qset) % SCULL_QLOCKS];
+}
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Find quantum number "index", or NULL if it's a hole. The list is
+ * walked from the head (and never extended); the index is a single
+ * lookup whatever the offset.
+ */
+void *scull_get_quantum(struct scull_dev *dev, unsigned long index)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
+	struct scull_qset *dptr = smp_load_acquire(&dev->data);
+	unsigned long item = index / dev->qset;
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	if (dev->indexed) {
+		scull_touch(dev, index, 0);
+		return xa_load(&dev->quanta, index);
+	}
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	while (dptr && item--)
+		dptr = smp_load_acquire(&dptr->next);
+	if (!dptr || !dptr->data)
+		return NULL;
+	return dptr->data[index % dev->qset];
+}
+EXPORT_SYMBOL(scull_get_quantum);
 
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
+/*
+ * Same as above, but allocate the quantum (and whatever leads to it)
+ * if it's not there yet, and make sure it's a plain one that can be
+ * written. Returns NULL only if out of memory. The caller holds the
+ * qset lock for writing.
+ */
+void *scull_alloc_quantum(struct scull_dev *dev, unsigned long index)
+{
+	struct scull_qset *dptr;
+	int s_pos = index % dev->qset;
+	void *quantum;
+
+	if (dev->indexed) {
+		quantum = scull_unzip(dev, index); /* if it was compressed */
+		if (scull_shared(quantum))
+			quantum = scull_unshare(dev, index);
+		if (quantum)
+			goto touch;
+		if (xa_load(&dev->quanta, index))
+			return NULL; /* it was, and we're out of memory */
+		quantum = scull_new_quantum(dev);
+		if (!quantum)
+			return NULL;
+		if (xa_err(xa_store(&dev->quanta, index, quantum, GFP_KERNEL))) {
+			scull_free_quantum(dev, quantum);
+			return NULL;
+		}
+	  touch:
+		scull_touch(dev, index, 1);
+		return quantum;
+	}
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+	/* follow the list up to the right position */
+	mutex_lock(&dev->alloc_lock);
+	dptr = scull_follow(dev, index / dev->qset);
+	mutex_unlock(&dev->alloc_lock);
+	if (dptr == NULL)
+		return NULL;
+	if (!dptr->data) {
+		dptr->data = kmalloc(dev->qset * sizeof(char *), GFP_KERNEL);
+		if (!dptr->data)
+			return NULL;
+		memset(dptr->data, 0, dev->qset * sizeof(char *));
+	}
+	if (!dptr->data[s_pos])
+		dptr->data[s_pos] = scull_new_quantum(dev);
+	return dptr->data[s_pos];
+}
+EXPORT_SYMBOL(scull_alloc_quantum);
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+/*
+ * Grow the device to "size" bytes, if it's smaller. Writers run
+ * concurrently, so this can't be a plain assignment.
+ */
+static void scull_extend(struct scull_dev *dev, unsigned long size)
+{
+	unsigned long old = READ_ONCE(dev->size), prev;
+
+	while (old < size) {
+		prev = cmpxchg(&dev->size, old, size);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/*
+ * Data management: read and write. A single call moves as much as
+ * the iterator asks for, going from one quantum to the next with the
+ * semaphore taken only once; plain read() and write() come here too.
+ *
+ * The device semaphore is only taken for reading, so I/O on different
+ * quantum sets runs in parallel; the per-qset lock is taken shared by
+ * readers and exclusive by writers as we step through the qsets.
+ *
+ * With IOCB_NOWAIT (RWF_NOWAIT, or io_uring trying inline), no lock is
+ * waited for and nothing that may sleep is done: quanta that would
+ * have to be allocated or decompressed end the transfer with -EAGAIN
+ * (or short, if something was moved already), and the caller retries
+ * from a context that can block.
+ *
+ * The user buffer may well be a mapping of this very device, whose
+ * fault handler takes the same locks: so the copies are done with page
+ * faults disabled. When one comes up short, all locks are dropped, the
+ * rest of the buffer is faulted in, and we start again from where we
+ * were (like generic_perform_write does).
+ *
+ * Appending writers are the exception: the offset they write at is the
+ * size, which they move, so they take the device semaphore for writing
+ * to have the size to themselves until they are done.
+ */
+
+/* Take a qset lock, or fail if we can't wait for it */
+static int scull_qlock_get(struct rw_semaphore *qlock, int write, int nowait)
+{
+	if (nowait)
+		return write ? down_write_trylock(qlock) : down_read_trylock(qlock);
+	if (write)
+		down_write(qlock);
+	else
+		down_read(qlock);
+	return 1;
+}
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	struct rw_semaphore *qlock = NULL, *next;
+	int nowait = iocb->ki_flags & IOCB_NOWAIT;
+	int quantum;
+	size_t count, chunk, copied;
+	unsigned long index, size;
+	int q_pos;
+	void *qptr;
+	ssize_t retval = 0;
+	int fault;
+
+  again:
+	if (nowait) {
+		if (!down_read_trylock(&dev->sem))
+			return retval ? retval : -EAGAIN;
+	} else if (down_read_killable(&dev->sem))
+		return retval ? retval : -ERESTARTSYS;
+	fault = 0;
+	quantum = dev->quantum; /* it may have changed, if we come back */
+	size = READ_ONCE(dev->size);
+	count = iov_iter_count(to);
+	if (iocb->ki_pos >= size)
 		goto out;
+	if (iocb->ki_pos + count > size)
+		count = size - iocb->ki_pos;
+
+	while (count) {
+		/* find the quantum, and the offset in it */
+		index = (unsigned long)iocb->ki_pos / quantum;
+		q_pos = (unsigned long)iocb->ki_pos % quantum;
+
+		next = scull_qlock(dev, index);
+		if (next != qlock) {
+			if (qlock)
+				up_read(qlock);
+			qlock = NULL;
+			if (!scull_qlock_get(next, 0, nowait))
+				goto eagain;
+			qlock = next;
+		}
+		qptr = scull_get_quantum(dev, index);
+		if (scull_zipped(qptr)) {
+			if (nowait)
+				goto eagain;
+			qptr = scull_unzip_shared(dev, index, qlock);
+			if (qptr == NULL) {
+				if (!retval)
+					retval = -ENOMEM;
+				break;
+			}
+		}
+
+		/* read only up to the end of this quantum, then go on */
+		chunk = min_t(size_t, count, quantum - q_pos);
+		pagefault_disable();
+		if (qptr == NULL) /* a hole: read zeros */
+			copied = iov_iter_zero(chunk, to);
+		else
+			copied = copy_to_iter(scull_qdata(qptr) + q_pos, chunk, to);
+		pagefault_enable();
+		iocb->ki_pos += copied;
+		retval += copied;
+		if (copied != chunk) {
+			fault = chunk - copied;
+			break;
+		}
+		count -= chunk;
+		continue;
+
+	  eagain: /* IOCB_NOWAIT, and we'd have to wait */
+		if (!retval)
+			retval = -EAGAIN;
+		break;
 	}
-	*f_pos += count;
-	retval = count;
+	if (qlock)
+		up_read(qlock);
 
   out:
-	mutex_unlock(&dev->lock);
+	up_read(&dev->sem);
+	if (fault) {
+		qlock = NULL;
+		if (!nowait && fault_in_iov_iter_writeable(to, fault) < fault)
+			goto again;
+		if (!retval)
+			retval = nowait ? -EAGAIN : -EFAULT;
+	}
 	return retval;
 }
+EXPORT_SYMBOL(scull_read_iter);
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
-
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	struct rw_semaphore *qlock = NULL, *next;
+	int nowait = iocb->ki_flags & IOCB_NOWAIT;
+	int append = iocb->ki_flags & IOCB_APPEND;
+	int quantum;
+	size_t count, chunk, copied;
+	unsigned long index;
+	int q_pos;
+	void *qptr;
+	ssize_t retval = 0;
+	int fault = 0;
+
+  again:
+	if (nowait) {
+		if (!(append ? down_write_trylock(&dev->sem) :
+				down_read_trylock(&dev->sem)))
+			return retval ? retval : -EAGAIN;
+	} else if (append ? down_write_killable(&dev->sem) :
+			down_read_killable(&dev->sem))
+		return retval ? retval : -ERESTARTSYS;
+	quantum = dev->quantum; /* it may have changed, if we come back */
+	count = iov_iter_count(from);
+	if (append && !fault)
+		iocb->ki_pos = dev->size;
+	fault = 0;
+
+	while (count) {
+		/* find the quantum, and the offset in it */
+		index = (unsigned long)iocb->ki_pos / quantum;
+		q_pos = (unsigned long)iocb->ki_pos % quantum;
+
+		next = scull_qlock(dev, index);
+		if (next != qlock) {
+			if (qlock)
+				up_write(qlock);
+			qlock = NULL;
+			if (!scull_qlock_get(next, 1, nowait))
+				goto eagain;
+			qlock = next;
+		}
+		if (nowait) {
+			/* only a plain quantum that's already there will do */
+			qptr = scull_get_quantum(dev, index);
+			if (!qptr || xa_pointer_tag(qptr))
+				goto eagain;
+			if (dev->indexed)
+				scull_touch(dev, index, 1);
+		} else
+			qptr = scull_alloc_quantum(dev, index);
+		if (qptr == NULL) {
+			if (!retval)
+				retval = -ENOMEM;
+			break;
+		}
 
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+		/* write only up to the end of this quantum, then go on */
+		chunk = min_t(size_t, count, quantum - q_pos);
+		pagefault_disable();
+		copied = copy_from_iter(qptr + q_pos, chunk, from);
+		pagefault_enable();
+		iocb->ki_pos += copied;
+		retval += copied;
+		if (copied != chunk) {
+			fault = chunk - copied;
+			break;
+		}
+		count -= chunk;
+		if (scull_dedup && !nowait && dev->indexed &&
+				q_pos + chunk == quantum)
+			scull_dedup_quantum(dev, index);
+		continue;
 
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
+	  eagain: /* IOCB_NOWAIT, and we'd have to wait */
+		if (!retval)
+			retval = -EAGAIN;
+		break;
 	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
+	if (qlock)
+		up_write(qlock);
+
+        /* update the size */
+	scull_extend(dev, iocb->ki_pos);
+
+	if (append)
+		up_write(&dev->sem);
+	else
+		up_read(&dev->sem);
+	if (fault) {
+		qlock = NULL;
+		if (!nowait && fault_in_iov_iter_readable(from, fault) < fault)
+			goto again;
+		if (!retval)
+			retval = nowait ? -EAGAIN : -EFAULT;
 	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	return retval;
+}
+EXPORT_SYMBOL(scull_write_iter);
+
+/*
+ * Splice. Writing needs nothing special, iter_file_splice_write hands
+ * the pipe pages to scull_write_iter. Reading can do better when the
+ * quanta are made of whole pages (the same case where mmap works):
+ * rather than copying, the pages themselves are put in the pipe, with
+ * a reference each. Like with the page cache, the pipe then sees any
+ * later write to the device; and a trim doesn't free a quantum until
+ * the pipe lets its pages go, as quanta are compound pages (or pages
+ * vmalloc()ed one by one, each with its own count).
+ */
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	__add_pipe_buf_confirm
+	.release =	generic_pipe_buf_release,
+	.get =		generic_pipe_buf_get,
+};
+
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+			  struct pipe_inode_info *pipe, size_t len,
+			  unsigned int flags)
+{
+	struct scull_dev *dev = in->private_data;
+	struct rw_semaphore *qlock;
+	struct pipe_buffer buf;
+	unsigned long index, size;
+	int quantum, q_pos, result;
+	size_t chunk;
+	void *qptr;
+	ssize_t retval = 0;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+	if (!scull_paged(dev)) {
+		/* kmalloc()ed quanta: let read_iter copy them */
+		up_read(&dev->sem);
+		return copy_splice_read(in, ppos, pipe, len, flags);
+	}
+	quantum = dev->quantum;
+	size = READ_ONCE(dev->size);
+	if (*ppos >= size)
 		goto out;
+	if (*ppos + len > size)
+		len = size - *ppos;
+
+	while (len) {
+		index = (unsigned long)*ppos / quantum;
+		q_pos = (unsigned long)*ppos % quantum;
+
+		qlock = scull_qlock(dev, index);
+		down_read(qlock);
+		qptr = scull_get_quantum(dev, index);
+		if (scull_zipped(qptr)) {
+			qptr = scull_unzip_shared(dev, index, qlock);
+			if (qptr == NULL) {
+				up_read(qlock);
+				if (!retval)
+					retval = -ENOMEM;
+				break;
+			}
+		}
+		/* a pipe buffer can't cross a page; holes read as zeros */
+		chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(q_pos));
+		buf = (struct pipe_buffer) {
+			.page =		qptr ? scull_qpage(scull_qdata(qptr) + q_pos) :
+					ZERO_PAGE(0),
+			.offset =	offset_in_page(q_pos),
+			.len =		chunk,
+			.ops =		&scull_pipe_buf_ops,
+		};
+		get_page(buf.page);
+		up_read(qlock);
+
+		result = add_to_pipe(pipe, &buf); /* drops the page on error */
+		if (result < 0) {
+			if (!retval)
+				retval = result;
+			break;
+		}
+		*ppos += chunk;
+		retval += chunk;
+		len -= chunk;
 	}
-	*f_pos += count;
-	retval = count;
-
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
 
   out:
-	mutex_unlock(&dev->lock);
+	up_read(&dev->sem);
 	return retval;
 }
+EXPORT_SYMBOL(scull_splice_read);
 
 /*
  * The ioctl() implementation
@@ -505,6 +1075,21 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	  case SCULL_P_IOCWAKE:
+		return scull_p_wake(filp);
+
+	  case SCULL_P_IOCRECVMMSG:
+		return scull_p_recvmmsg(filp, arg);
+
+	  case SCULL_IOCSALLOC:
+	  case SCULL_IOCGALLOCSTAT:
+	  case SCULL_IOCSNUMA:
+	  case SCULL_IOCGNUMA:
+		/* for the bare devices, and those sharing their read method */
+		if (filp->f_op->read_iter != scull_read_iter)
+			return -ENOTTY;
+		return scull_alloc_ioctl(filp, cmd, arg);
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -513,12 +1098,193 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/*
+ * Make quantum "index" a hole, as it is in the source of a copy. A
+ * mapped device keeps its quanta (see the trim): clear it instead.
+ */
+static int scull_drop_quantum(struct scull_dev *dev, unsigned long index)
+{
+	struct scull_qset *dptr;
+	unsigned long item = index / dev->qset;
+	void *quantum;
+
+	if (!scull_get_quantum(dev, index))
+		return 0;
+	if (atomic_read(&dev->vmas)) {
+		quantum = scull_alloc_quantum(dev, index); /* a plain one */
+		if (!quantum)
+			return -ENOMEM;
+		memset(quantum, 0, dev->quantum);
+		return 0;
+	}
+	if (dev->indexed) {
+		scull_free_range(dev, index, index);
+		return 0;
+	}
+	for (dptr = dev->data; item--; dptr = dptr->next)
+		;
+	scull_free_quantum(dev, dptr->data[index % dev->qset]);
+	dptr->data[index % dev->qset] = NULL;
+	return 0;
+}
+
+/*
+ * Copy "count" quanta from quantum "src" on, to quantum "dst" on, in
+ * one go; with scull_dedup the copies end up shared with the source.
+ * The copy stops at the end of the source, and may extend the device
+ * but not start past its end: "dst" and "count" come from user space,
+ * and anything else would let them allocate as much as they please.
+ * The caller holds dev->sem for writing, so nobody else is around.
+ */
+static int scull_copy_quanta(struct scull_dev *dev, unsigned long long src,
+		unsigned long dst, unsigned long count)
+{
+	unsigned long i, s, d, end, quantum = dev->quantum;
+	unsigned long nr = DIV_ROUND_UP(dev->size, quantum); /* quanta in use */
+	void *from, *to;
+	loff_t len;
+
+	if (count == 0 || src >= nr || dst > nr)
+		return -EINVAL;
+	count = min(count, nr - (unsigned long)src);
+	if (check_add_overflow(dst, count, &end) ||
+			end > MAX_LFS_FILESIZE / quantum)
+		return -EFBIG;
+	if (src == dst)
+		return 0;
+	/* the data we copy; the last quantum may be partly used */
+	len = min_t(loff_t, (src + count) * quantum, dev->size) - src * quantum;
+
+	for (i = 0; i < count; i++) {
+		/* go backwards if the ranges overlap that way */
+		s = dst > src ? src + count - 1 - i : src + i;
+		d = dst > src ? dst + count - 1 - i : dst + i;
+		from = scull_get_quantum(dev, s);
+		if (!from) { /* a hole stays one */
+			if (scull_drop_quantum(dev, d))
+				return -ENOMEM;
+			continue;
+		}
+		if (scull_zipped(from) && !(from = scull_unzip(dev, s)))
+			return -ENOMEM;
+		to = scull_alloc_quantum(dev, d);
+		if (!to)
+			return -ENOMEM;
+		memcpy(to, scull_qdata(from), quantum);
+		if (scull_dedup && dev->indexed)
+			scull_dedup_quantum(dev, d);
+	}
+	if (dev->size < (loff_t)dst * quantum + len)
+		dev->size = (loff_t)dst * quantum + len;
+	return 0;
+}
+
+/*
+ * The io_uring passthrough method: a control plane can queue commands
+ * in a ring (polled by a kernel thread with IORING_SETUP_SQPOLL, if it
+ * wants) instead of paying for a syscall each. Everything completes
+ * right away; what would sleep when io_uring asks us not to is sent
+ * back with -EAGAIN, and io_uring issues it again from a worker.
+ */
+static int scull_uring_cmd(struct io_uring_cmd *ioucmd,
+		unsigned int issue_flags)
+{
+	const struct scull_ucmd *uc = io_uring_sqe_cmd_wrapper(ioucmd);
+	struct file *filp = ioucmd->file;
+	struct scull_dev *dev = filp->private_data;
+	int nonblock = issue_flags & IO_URING_F_NONBLOCK;
+	int retval;
+
+	switch (ioucmd->cmd_op) {
+	  case SCULL_UCMD_TRIM:
+	  case SCULL_UCMD_COPY:
+		if (filp->f_op->read_iter != scull_read_iter)
+			return -ENOTTY;
+		if (nonblock) {
+			if (!down_write_trylock(&dev->sem))
+				return -EAGAIN;
+		} else if (down_write_killable(&dev->sem))
+			return -EINTR;
+		if (ioucmd->cmd_op == SCULL_UCMD_TRIM)
+			retval = scull_trim(dev);
+		else
+			retval = scull_copy_quanta(dev, READ_ONCE(uc->arg),
+					READ_ONCE(uc->dst), READ_ONCE(uc->count));
+		up_write(&dev->sem);
+		return retval;
+
+	  case SCULL_P_IOCWAKE:
+	  case SCULL_P_IOCRECVMMSG:
+	  case SCULL_IOCSALLOC: /* these may sleep */
+	  case SCULL_IOCSNUMA:
+		if (nonblock)
+			return -EAGAIN;
+		break;
+	}
+	return scull_ioctl(filp, ioucmd->cmd_op, READ_ONCE(uc->arg));
+}
+
+#endif /* 5.19 */
+
 
 
 /*
  * The "extended" operations -- only seek
  */
 
+/*
+ * SEEK_DATA and SEEK_HOLE. The quantum is the unit of allocation, so a
+ * hole is a quantum that isn't there: never written, punched out, or
+ * found to be zeros by scull_dedup. The end of the device is a hole too.
+ */
+static loff_t scull_seek_hole_data(struct scull_dev *dev, loff_t off,
+		int whence)
+{
+	struct scull_qset *dptr = NULL;
+	unsigned long index, last, n;
+	loff_t pos;
+	int present;
+
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+	pos = -ENXIO;
+	if (off < 0 || off >= dev->size)
+		goto out;
+	index = off / dev->quantum;
+	last = (dev->size - 1) / dev->quantum;
+
+	if (dev->indexed && whence == SEEK_DATA) { /* skip holes at once */
+		if (xa_find(&dev->quanta, &index, last, XA_PRESENT))
+			pos = max_t(loff_t, off, (loff_t)index * dev->quantum);
+		goto out;
+	}
+	if (!dev->indexed) {
+		dptr = smp_load_acquire(&dev->data);
+		for (n = index / dev->qset; dptr && n; n--)
+			dptr = smp_load_acquire(&dptr->next);
+	}
+	for (; index <= last; index++) {
+		if (dev->indexed) {
+			present = xa_load(&dev->quanta, index) != NULL;
+		} else {
+			present = dptr && dptr->data &&
+				dptr->data[index % dev->qset];
+			if (dptr && (index + 1) % dev->qset == 0)
+				dptr = smp_load_acquire(&dptr->next);
+		}
+		if (present == (whence == SEEK_DATA))
+			break;
+	}
+	if (index <= last)
+		pos = max_t(loff_t, off, (loff_t)index * dev->quantum);
+	else if (whence == SEEK_HOLE)
+		pos = dev->size;
+  out:
+	up_read(&dev->sem);
+	return pos;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
 	struct scull_dev *dev = filp->private_data;
@@ -537,6 +1303,13 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	  case SEEK_DATA:
+	  case SEEK_HOLE:
+		newpos = scull_seek_hole_data(dev, off, whence);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	  default: /* can't happen */
 		return -EINVAL;
 	}
@@ -544,15 +1317,111 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 	filp->f_pos = newpos;
 	return newpos;
 }
+EXPORT_SYMBOL(scull_llseek);
+
+/*
+ * Clear the part of quantum "index" that is between "start" and "end",
+ * unless it's a hole already.
+ */
+static int scull_clear_partial(struct scull_dev *dev, unsigned long index,
+		loff_t start, loff_t end)
+{
+	loff_t qstart = (loff_t)index * dev->quantum;
+	void *quantum;
+
+	if (!scull_get_quantum(dev, index))
+		return 0;
+	quantum = scull_alloc_quantum(dev, index); /* a plain one */
+	if (!quantum)
+		return -ENOMEM;
+	start = max(start, qstart);
+	end = min(end, qstart + dev->quantum);
+	memset(quantum + (start - qstart), 0, end - start);
+	return 0;
+}
+
+/*
+ * fallocate: only FALLOC_FL_PUNCH_HOLE (with FALLOC_FL_KEEP_SIZE, as
+ * the VFS demands). The quanta entirely within the range are freed,
+ * the ends of it are cleared in place. Like a trim, it's refused while
+ * the device is mapped.
+ */
+long scull_fallocate(struct file *filp, int mode, loff_t offset,
+		loff_t len)
+{
+	struct scull_dev *dev = filp->private_data;
+	unsigned long first, last, index; /* the quanta to free: [first, last) */
+	loff_t end = offset + len;
+	struct scull_qset *dptr;
+	long retval = 0;
+	int i;
+
+	if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+	if (atomic_read(&dev->vmas)) {
+		retval = -EBUSY;
+		goto out;
+	}
+	if (end >= dev->size) /* past the end, whole quanta can go */
+		end = roundup(dev->size, (unsigned long)dev->quantum);
+	if (offset >= end)
+		goto out;
+
+	/* within the size now, so both fit an unsigned long, like it */
+	first = DIV_ROUND_UP((unsigned long)offset, dev->quantum);
+	last = (unsigned long)end / dev->quantum;
+	if (first > last) { /* all within one quantum */
+		retval = scull_clear_partial(dev, last, offset, end);
+		goto out;
+	}
+	if ((loff_t)first * dev->quantum > offset)
+		retval = scull_clear_partial(dev, first - 1, offset, end);
+	if (!retval && (loff_t)last * dev->quantum < end)
+		retval = scull_clear_partial(dev, last, offset, end);
+	if (retval || first == last)
+		goto out;
+
+	if (dev->indexed) {
+		scull_free_range(dev, first, last - 1);
+		goto out;
+	}
+	dptr = dev->data;
+	for (index = 0; dptr && index + dev->qset <= first; index += dev->qset)
+		dptr = dptr->next;
+	for (; dptr && index < last; dptr = dptr->next, index += dev->qset) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < dev->qset; i++) {
+			if (index + i < first || index + i >= last)
+				continue;
+			scull_free_quantum(dev, dptr->data[i]);
+			dptr->data[i] = NULL;
+		}
+	}
+  out:
+	up_write(&dev->sem);
+	return retval;
+}
+EXPORT_SYMBOL(scull_fallocate);
 
 
 
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
+	.fallocate = scull_fallocate,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	.uring_cmd = scull_uring_cmd,
+#endif
+	.mmap =     scull_mmap,
+	.get_unmapped_area = thp_get_unmapped_area, /* PMD-aligned, if huge */
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -574,7 +1443,9 @@ void scull_cleanup_module(void)
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
+			scull_zip_stop(scull_devices + i);
 			scull_trim(scull_devices + i);
+			scull_alloc_release(scull_devices + i);
 			cdev_del(&scull_devices[i].cdev);
 		}
 		kfree(scull_devices);
@@ -590,6 +1461,9 @@ void scull_cleanup_module(void)
 	/* and call the cleanup functions for friend devices */
 	scull_p_cleanup();
 	scull_access_cleanup();
+	scull_pc_cleanup();
+	scull_zip_cleanup();
+	scull_alloc_cleanup();
 
 }
 
@@ -642,12 +1516,24 @@ int scull_init_module(void)
 		goto fail;  /* Make this more graceful */
 	}
 	memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
+	scull_zip_init();
+	scull_alloc_init();
+	if (scull_numa_check(scull_numa, scull_node)) {
+		printk(KERN_WARNING "scull: bad NUMA policy %i, node %i:"
+				" using local allocation\n", scull_numa, scull_node);
+		scull_numa = SCULL_NUMA_LOCAL;
+	}
 
         /* Initialize each device. */
 	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
-		scull_devices[i].qset = scull_qset;
-		mutex_init(&scull_devices[i].lock);
+		scull_dev_init(&scull_devices[i], NULL);
+		scull_devices[i].alloc = scull_alloc_pick(scull_alloc, i);
+		if (!scull_devices[i].alloc) {
+			printk(KERN_WARNING "scull: unknown allocator for scull%i,"
+					" using \"%s\"\n", i, scull_alloc_default->name);
+			scull_devices[i].alloc = scull_alloc_default;
+		}
+		scull_zip_start(&scull_devices[i]);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
@@ -655,6 +1541,7 @@ int scull_init_module(void)
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);
+	dev += scull_pc_init(dev);
 
 #ifdef SCULL_DEBUG /* only when debugging */
 	scull_create_proc();
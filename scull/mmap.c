@@ -0,0 +1,382 @@
+/*
+ * mmap.c -- memory mapping for the devices built on scull_dev
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/mm.h>		/* everything */
+#include <linux/errno.h>	/* error codes */
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+#include <linux/huge_mm.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,15,0)
+#include <linux/pfn_t.h>
+#endif
+
+#include "scull.h"		/* local definitions */
+
+/* Pages mapped by each fault, see scull_vma_around */
+static int scull_fault_around = 2048;
+module_param(scull_fault_around, int, S_IRUGO | S_IWUSR);
+
+/*
+ * What a VMA remembers: the device, and the last qset it looked up,
+ * so that faults near the previous one don't walk the list from the
+ * start. Split VMAs share it, hence the refcount. Qsets only go away
+ * with a trim, which is refused while the device is mapped.
+ */
+struct scull_vma {
+	struct kref ref;
+	struct scull_dev *dev;
+	struct mutex lock;        /* protects the two below */
+	unsigned long item;       /* qset number of "dptr" */
+	struct scull_qset *dptr;  /* NULL if nothing cached yet */
+};
+
+static void scull_vma_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct scull_vma, ref));
+}
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it.
+ */
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_vma *priv = vma->vm_private_data;
+
+	kref_get(&priv->ref);
+	atomic_inc(&priv->dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_vma *priv = vma->vm_private_data;
+
+	atomic_dec(&priv->dev->vmas);
+	kref_put(&priv->ref, scull_vma_free);
+}
+
+/*
+ * Find quantum number "index", or NULL if it's a hole; in list mode,
+ * starting from the cached qset if it's not past it. Called with the
+ * device semaphore held.
+ */
+static void *scull_vma_quantum(struct scull_vma *priv, unsigned long index)
+{
+	struct scull_dev *dev = priv->dev;
+	unsigned long item = index / dev->qset, i = 0;
+	struct scull_qset *dptr;
+
+	if (dev->indexed)
+		return scull_get_quantum(dev, index);
+
+	mutex_lock(&priv->lock);
+	dptr = smp_load_acquire(&dev->data);
+	if (priv->dptr && priv->item <= item) {
+		dptr = priv->dptr;
+		i = priv->item;
+	}
+	for (; dptr && i < item; i++)
+		dptr = smp_load_acquire(&dptr->next);
+	if (dptr) {
+		priv->dptr = dptr;
+		priv->item = item;
+	}
+	mutex_unlock(&priv->lock);
+	if (!dptr || !dptr->data)
+		return NULL;
+	return dptr->data[index % dev->qset];
+}
+
+/* Map one page, in the way the VMA was set up for */
+static int scull_vma_insert(struct vm_area_struct *vma, unsigned long addr,
+		struct page *page)
+{
+	if (vma->vm_flags & VM_PFNMAP)
+		return vmf_insert_pfn(vma, addr, page_to_pfn(page)) ==
+			VM_FAULT_NOPAGE ? 0 : -ENOMEM;
+	return vm_insert_page(vma, addr, page);
+}
+
+/*
+ * Map the neighbours of a faulting page: the whole quantum that was
+ * hit, and then as much of the following quanta in the same qset as
+ * fits in "scull_fault_around" pages. Faulting pages one by one is just
+ * too slow for sequential scans, and it's also what keeps MAP_POPULATE
+ * cheap: after the first fault of a window, the others find their
+ * pages already mapped.
+ *
+ * Holes, and quanta that aren't plain ones (compressed, or shared),
+ * are left to their own faults. The caller holds the qset lock.
+ */
+static void scull_vma_around(struct vm_fault *vmf, unsigned long index)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_vma *priv = vma->vm_private_data;
+	struct scull_dev *dev = priv->dev;
+	unsigned long quantum = dev->quantum;
+	unsigned long base = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+	unsigned long start, end, addr, off, last = ULONG_MAX;
+	void *qptr = NULL;
+	int err;
+
+	/* the window: from the start of this quantum, within the qset */
+	start = (vmf->address & PAGE_MASK) - offset % quantum;
+	end = start + ((unsigned long)READ_ONCE(scull_fault_around) << PAGE_SHIFT);
+	end = min(end, start + (dev->qset - index % dev->qset) * quantum);
+	end = min(end, vma->vm_start + PAGE_ALIGN(READ_ONCE(dev->size)) - base);
+	start = max(start, vma->vm_start);
+	end = min(end, vma->vm_end);
+
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		if (addr == (vmf->address & PAGE_MASK))
+			continue; /* the caller maps that one */
+		off = addr - vma->vm_start + base;
+		if (off / quantum != last) {
+			last = off / quantum;
+			qptr = scull_vma_quantum(priv, last);
+		}
+		if (!qptr || xa_pointer_tag(qptr))
+			continue;
+		err = scull_vma_insert(vma, addr, scull_qpage(qptr + off % quantum));
+		if (err && err != -EBUSY) /* -EBUSY: already mapped */
+			break;
+	}
+}
+
+/*
+ * The fault method: find the quantum holding the page, and hand the
+ * page itself to the process, together with its neighbours (see
+ * above) when the VMA lets us insert pages ourselves. Quanta are
+ * compound pages, or vmalloc()ed ones, so the reference we take on a
+ * page is accounted to its quantum, which is only freed by a trim; and
+ * trims are refused while the device is mapped.
+ *
+ * Holes are filled, and shared or compressed quanta get a copy of their
+ * own first, as the process may write to them. The area past the end
+ * of the device gets a SIGBUS.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+typedef int vm_fault_t;
+#endif
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_vma *priv = vma->vm_private_data;
+	struct scull_dev *dev = priv->dev;
+	unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+	struct rw_semaphore *qlock;
+	unsigned long index;
+	void *qptr;
+	struct page *page;
+	vm_fault_t retval = VM_FAULT_SIGBUS;
+
+	down_read(&dev->sem);
+	if (offset >= READ_ONCE(dev->size))
+		goto out; /* out of range */
+
+	index = offset / dev->quantum;
+	qlock = scull_qlock(dev, index);
+	down_read(qlock);
+	qptr = scull_vma_quantum(priv, index);
+	if (!qptr || xa_pointer_tag(qptr)) {
+		/* a hole, or not a quantum of its own: make it one */
+		up_read(qlock);
+		down_write(qlock);
+		qptr = scull_alloc_quantum(dev, index);
+		downgrade_write(qlock);
+	}
+	if (qptr) {
+		if (vma->vm_flags & (VM_MIXEDMAP | VM_PFNMAP))
+			scull_vma_around(vmf, index);
+		page = scull_qpage(qptr + offset % dev->quantum);
+		if (vma->vm_flags & VM_PFNMAP) {
+			retval = vmf_insert_pfn(vma, vmf->address & PAGE_MASK,
+					page_to_pfn(page));
+		} else {
+			get_page(page);
+			vmf->page = page;
+			retval = 0;
+		}
+	}
+	up_read(qlock);
+
+  out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+/*
+ * When a quantum is exactly what a PMD maps, and it's a compound page,
+ * a 2MB-aligned part of the mapping can point to it with a single
+ * entry: one fault (and one TLB entry) instead of 512. Anything else
+ * falls back to "fault".
+ *
+ * The core calls this for VMAs marked VM_HUGEPAGE (set at mmap) unless
+ * transparent huge pages are "never"; thp_get_unmapped_area gives
+ * PMD-aligned addresses.
+ */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+#define SCULL_HUGE_FAULT
+
+static vm_fault_t scull_vma_pmd_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_vma *priv = vma->vm_private_data;
+	struct scull_dev *dev = priv->dev;
+	unsigned long haddr = vmf->address & HPAGE_PMD_MASK;
+	struct rw_semaphore *qlock;
+	unsigned long offset, index;
+	void *quantum;
+	vm_fault_t retval = VM_FAULT_FALLBACK;
+
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	offset = (haddr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+
+	down_read(&dev->sem);
+	if (dev->quantum != HPAGE_PMD_SIZE || offset % HPAGE_PMD_SIZE ||
+			offset + HPAGE_PMD_SIZE > PAGE_ALIGN(READ_ONCE(dev->size)))
+		goto out;
+	index = offset / dev->quantum;
+	qlock = scull_qlock(dev, index);
+	down_read(qlock);
+	quantum = scull_vma_quantum(priv, index);
+	/* holes, shared quanta and vmalloc()ed ones are for "fault" */
+	if (!quantum || xa_pointer_tag(quantum) || is_vmalloc_addr(quantum))
+		goto unlock;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0)
+	retval = vmf_insert_folio_pmd(vmf, virt_to_folio(quantum),
+			vmf->flags & FAULT_FLAG_WRITE);
+#else
+	/* no refcounting here: VM_PFNMAP, and "vmas" holds the trim */
+	retval = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(virt_to_pfn(quantum)),
+			vmf->flags & FAULT_FLAG_WRITE);
+#endif
+  unlock:
+	up_read(qlock);
+  out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+static vm_fault_t scull_vma_huge_fault(struct vm_fault *vmf,
+		unsigned int order)
+{
+	if (order != HPAGE_PMD_ORDER)
+		return VM_FAULT_FALLBACK;
+	return scull_vma_pmd_fault(vmf);
+}
+#else
+static vm_fault_t scull_vma_huge_fault(struct vm_fault *vmf,
+		enum page_entry_size pe_size)
+{
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	return scull_vma_pmd_fault(vmf);
+}
+#endif
+#endif /* huge faults */
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open =     scull_vma_open,
+	.close =    scull_vma_close,
+	.fault =    scull_vma_fault,
+#ifdef SCULL_HUGE_FAULT
+	.huge_fault = scull_vma_huge_fault,
+#endif
+};
+
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = filp->private_data;
+	unsigned long flags = VM_MIXEDMAP; /* "fault" inserts pages itself */
+	unsigned long clear = 0;
+	struct scull_vma *priv;
+	int retval = 0;
+
+	/* the semaphore keeps a trim from changing the quantum under us */
+	down_read(&dev->sem);
+
+	/* refuse to map if quanta are not made of whole pages */
+	if (!scull_paged(dev)) {
+		retval = -ENODEV;
+		goto out;
+	}
+
+#ifdef SCULL_HUGE_FAULT
+	/*
+	 * Ask for huge faults. Before 6.15 a PMD can't map a plain
+	 * compound page with its refcount, only a pfn: then the whole
+	 * VMA is a pfn mapping, and "fault" inserts pfns too. Later,
+	 * PMDs map the folios, and pages can't be mixed in.
+	 *
+	 * A pfn mapping can't be copied on write, so it must be shared,
+	 * or private and never writable.
+	 */
+	if (dev->alloc->compound && dev->quantum == HPAGE_PMD_SIZE) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0)
+		flags = VM_HUGEPAGE;
+#else
+		flags = VM_HUGEPAGE | VM_PFNMAP;
+		if (!(vma->vm_flags & VM_SHARED)) {
+			if (vma->vm_flags & VM_WRITE) {
+				retval = -EINVAL;
+				goto out;
+			}
+			clear = VM_MAYWRITE; /* no mprotect to writable either */
+		}
+#endif
+	}
+#endif
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	kref_init(&priv->ref); /* dropped by scull_vma_close */
+	mutex_init(&priv->lock);
+	priv->dev = dev;
+
+	/* don't do anything here: "fault" will set up page table entries */
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_private_data = priv;
+	atomic_inc(&dev->vmas); /* like scull_vma_open, without the kref_get */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_mod(vma, flags, clear);
+#else
+	vma->vm_flags = (vma->vm_flags | flags) & ~clear;
+#endif
+
+  out:
+	up_read(&dev->sem);
+	return retval;
+}
+EXPORT_SYMBOL(scull_mmap);
@@ -0,0 +1,491 @@
+/*
+ * percpu.c -- the per-CPU scull device, for write-mostly logging
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/cdev.h>
+#include <linux/percpu.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/timekeeping.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "proc_ops_version.h"
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Every write() is a record, appended to a chain of chunks that belongs
+ * to the CPU the writer runs on. Writers on different CPUs share
+ * nothing but the read side of a per-CPU rw semaphore, which only keeps
+ * a trim away; writers on the same CPU serialize on that CPU's mutex,
+ * which also keeps each chain sorted by timestamp. A record is
+ * published by moving "used" forward with release semantics, and a new
+ * chunk by storing "next" the same way, so readers take no lock
+ * against writers at all. A read() merges the chains by timestamp.
+ *
+ * A writer on another CPU may have taken an older timestamp than the
+ * records a reader sees, and not have published it yet. So each writer
+ * announces in "pending" a time no later than its timestamp before
+ * taking it, and readers only hand out the records older than all the
+ * announcements they find (see scull_pc_watermark): those that could
+ * still show up are younger, and come out in order in a later read.
+ */
+#define SCULL_PC_CHUNK	PAGE_SIZE
+
+struct scull_pc_chunk {
+	struct scull_pc_chunk *next;	/* published after the last record */
+	unsigned long used;		/* bytes of records published */
+	char data[];			/* records, 8-byte aligned */
+};
+#define SCULL_PC_DATA	(SCULL_PC_CHUNK - offsetof(struct scull_pc_chunk, data))
+
+struct scull_pc_cpu {
+	struct mutex lock;		/* writers on this CPU */
+	struct scull_pc_chunk *first, *last;
+	atomic64_t pending;		/* a record is being timestamped, 0: none */
+};
+
+struct scull_pc_dev {
+	struct scull_pc_cpu __percpu *cpus;
+	struct percpu_rw_semaphore sem;	/* write side is the trim */
+	unsigned long gen;		/* bumped by each trim */
+	struct cdev cdev;
+};
+
+/* Where a reader is in each chain */
+struct scull_pc_pos {
+	struct scull_pc_chunk *chunk;
+	unsigned long off;
+};
+
+struct scull_pc_file {
+	struct scull_pc_dev *dev;
+	struct mutex lock;		/* the positions below */
+	unsigned long gen;		/* they are stale if != dev->gen */
+	struct scull_pc_pos pos[];	/* nr_cpu_ids of them */
+};
+
+static struct scull_pc_dev scull_pc_device;
+static dev_t scull_pc_devno;
+
+/*
+ * Free all chains; readers notice the new generation and start over.
+ */
+static void scull_pc_trim(struct scull_pc_dev *dev)
+{
+	struct scull_pc_chunk *chunk, *next;
+	struct scull_pc_cpu *pc;
+	int cpu;
+
+	percpu_down_write(&dev->sem);
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(dev->cpus, cpu);
+		for (chunk = pc->first; chunk; chunk = next) {
+			next = chunk->next;
+			kfree(chunk);
+		}
+		pc->first = pc->last = NULL;
+	}
+	dev->gen++;
+	percpu_up_write(&dev->sem);
+}
+
+/*
+ * Return the next record in one chain, or NULL. "next" is loaded
+ * before "used", so that once a chunk has a successor we see all of
+ * its records before leaving it.
+ */
+static struct scull_pc_rec *scull_pc_peek(struct scull_pc_dev *dev,
+		struct scull_pc_pos *pos, int cpu)
+{
+	struct scull_pc_chunk *next;
+
+	if (!pos->chunk) {
+		pos->chunk = smp_load_acquire(&per_cpu_ptr(dev->cpus, cpu)->first);
+		pos->off = 0;
+		if (!pos->chunk)
+			return NULL;
+	}
+	for (;;) {
+		next = smp_load_acquire(&pos->chunk->next);
+		if (pos->off < smp_load_acquire(&pos->chunk->used))
+			return (struct scull_pc_rec *)(pos->chunk->data + pos->off);
+		if (!next)
+			return NULL;
+		pos->chunk = next;
+		pos->off = 0;
+	}
+}
+
+/*
+ * The time before which every record is published: now, or the oldest
+ * announcement of a writer if there's one. The barrier pairs with the
+ * one in scull_pc_write: a writer whose announcement we miss reads the
+ * clock after we did. Records are looked at after this.
+ */
+static u64 scull_pc_watermark(struct scull_pc_dev *dev)
+{
+	u64 mark = ktime_get_ns(), ts;
+	int cpu;
+
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		ts = atomic64_read_acquire(
+				&per_cpu_ptr(dev->cpus, cpu)->pending);
+		if (ts && ts < mark)
+			mark = ts;
+	}
+	return mark;
+}
+
+/*
+ * The oldest record at the head of all chains, if it's older than
+ * "mark"; its CPU in *cpup.
+ */
+static struct scull_pc_rec *scull_pc_oldest(struct scull_pc_dev *dev,
+		struct scull_pc_pos *pos, int *cpup, u64 mark)
+{
+	struct scull_pc_rec *rec, *best = NULL;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		rec = scull_pc_peek(dev, pos + cpu, cpu);
+		if (rec && (!best || rec->ts < best->ts)) {
+			best = rec;
+			*cpup = cpu;
+		}
+	}
+	return best && best->ts < mark ? best : NULL;
+}
+
+static inline size_t scull_pc_reclen(struct scull_pc_rec *rec)
+{
+	return sizeof(*rec) + rec->len;
+}
+
+
+/*
+ * Open and close. A write-only open doesn't trim, as there are usually
+ * many writers; open with O_TRUNC to empty the device.
+ */
+static int scull_pc_open(struct inode *inode, struct file *filp)
+{
+	struct scull_pc_dev *dev;
+	struct scull_pc_file *pf;
+
+	dev = container_of(inode->i_cdev, struct scull_pc_dev, cdev);
+	pf = kzalloc(sizeof(*pf) + nr_cpu_ids * sizeof(pf->pos[0]), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	pf->dev = dev;
+	mutex_init(&pf->lock);
+	if ((filp->f_flags & O_TRUNC) && (filp->f_mode & FMODE_WRITE))
+		scull_pc_trim(dev);
+	pf->gen = dev->gen;
+	filp->private_data = pf;
+	return nonseekable_open(inode, filp);
+}
+
+static int scull_pc_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+/*
+ * Data management: read returns as many whole records as fit, each a
+ * struct scull_pc_rec followed by its payload, oldest first.
+ */
+static ssize_t scull_pc_read(struct file *filp, char __user *buf, size_t count,
+		loff_t *f_pos)
+{
+	struct scull_pc_file *pf = filp->private_data;
+	struct scull_pc_dev *dev = pf->dev;
+	struct scull_pc_rec *rec;
+	size_t len;
+	ssize_t retval = 0;
+	u64 mark;
+	int cpu;
+
+	percpu_down_read(&dev->sem);
+	if (mutex_lock_interruptible(&pf->lock)) {
+		retval = -ERESTARTSYS;
+		goto out;
+	}
+	if (pf->gen != dev->gen) {
+		/* trimmed since we last looked: start over */
+		memset(pf->pos, 0, nr_cpu_ids * sizeof(pf->pos[0]));
+		pf->gen = dev->gen;
+	}
+
+	mark = scull_pc_watermark(dev);
+	while ((rec = scull_pc_oldest(dev, pf->pos, &cpu, mark)) != NULL) {
+		len = scull_pc_reclen(rec);
+		if (len > count - retval) {
+			if (!retval)
+				retval = -EINVAL; /* can't split a record */
+			break;
+		}
+		if (copy_to_user(buf + retval, rec, len)) {
+			if (!retval)
+				retval = -EFAULT;
+			break;
+		}
+		retval += len;
+		pf->pos[cpu].off += ALIGN(len, 8);
+	}
+	mutex_unlock(&pf->lock);
+
+  out:
+	percpu_up_read(&dev->sem);
+	return retval;
+}
+
+/*
+ * A write is one record; what doesn't fit in a chunk is left to the
+ * next write(), as with any short write.
+ */
+static ssize_t scull_pc_write(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct scull_pc_file *pf = filp->private_data;
+	struct scull_pc_dev *dev = pf->dev;
+	struct scull_pc_chunk *chunk, *new;
+	struct scull_pc_cpu *pc;
+	struct scull_pc_rec *rec;
+	size_t reclen;
+	ssize_t retval;
+	int cpu;
+
+	count = min_t(size_t, count, SCULL_PC_DATA - sizeof(*rec));
+	reclen = ALIGN(sizeof(*rec) + count, 8);
+
+	percpu_down_read(&dev->sem);
+	/* if we migrate after this, we just lose some locality */
+	cpu = raw_smp_processor_id();
+	pc = per_cpu_ptr(dev->cpus, cpu);
+	if (mutex_lock_interruptible(&pc->lock)) {
+		retval = -ERESTARTSYS;
+		goto out;
+	}
+
+	chunk = pc->last;
+	if (!chunk || chunk->used + reclen > SCULL_PC_DATA) {
+		new = kmalloc(SCULL_PC_CHUNK, GFP_KERNEL);
+		if (!new) {
+			retval = -ENOMEM;
+			goto unlock;
+		}
+		new->next = NULL;
+		new->used = 0;
+		if (chunk)
+			smp_store_release(&chunk->next, new);
+		else
+			smp_store_release(&pc->first, new);
+		pc->last = chunk = new;
+	}
+
+	rec = (struct scull_pc_rec *)(chunk->data + chunk->used);
+	if (copy_from_user(rec + 1, buf, count)) {
+		retval = -EFAULT;
+		goto unlock;
+	}
+	rec->len = count;
+	rec->cpu = cpu;
+	/* announce it first (see scull_pc_watermark) */
+	atomic64_set(&pc->pending, ktime_get_ns());
+	smp_mb();
+	rec->ts = ktime_get_ns(); /* under the lock: the chain stays sorted */
+	smp_store_release(&chunk->used, chunk->used + reclen);
+	atomic64_set_release(&pc->pending, 0);
+	retval = count;
+
+  unlock:
+	mutex_unlock(&pc->lock);
+  out:
+	percpu_up_read(&dev->sem);
+	return retval;
+}
+
+
+#ifdef SCULL_DEBUG
+
+/*
+ * The merged view, one line per record, as a sequence: the position is
+ * the number of the record. The cursors are kept from one start to the
+ * next, and rebuilt (skipping as many records) if the device was
+ * trimmed meanwhile or we're asked to go back.
+ */
+struct scull_pc_seq {
+	unsigned long gen;		/* of the cursors */
+	loff_t n;			/* the number of the next record */
+	u64 mark;			/* see scull_pc_watermark */
+	int cpu;			/* of the next record */
+	struct scull_pc_pos pos[];	/* nr_cpu_ids of them */
+};
+
+static void *scull_pc_seq_next(struct seq_file *s, void *v, loff_t *spos)
+{
+	struct scull_pc_seq *it = s->private;
+	struct scull_pc_rec *rec = v;
+
+	it->pos[it->cpu].off += ALIGN(scull_pc_reclen(rec), 8);
+	it->n++;
+	*spos = it->n;
+	return scull_pc_oldest(&scull_pc_device, it->pos, &it->cpu, it->mark);
+}
+
+static void *scull_pc_seq_start(struct seq_file *s, loff_t *spos)
+{
+	struct scull_pc_dev *dev = &scull_pc_device;
+	struct scull_pc_seq *it = s->private;
+	struct scull_pc_rec *rec;
+	loff_t want = *spos;
+
+	percpu_down_read(&dev->sem);
+	if (want == 0 || want < it->n || it->gen != dev->gen) {
+		memset(it->pos, 0, nr_cpu_ids * sizeof(it->pos[0]));
+		it->gen = dev->gen;
+		it->n = 0;
+		it->mark = scull_pc_watermark(dev);
+	}
+	rec = scull_pc_oldest(dev, it->pos, &it->cpu, it->mark);
+	while (rec && it->n < want)
+		rec = scull_pc_seq_next(s, rec, spos);
+	return rec;
+}
+
+static void scull_pc_seq_stop(struct seq_file *s, void *v)
+{
+	percpu_up_read(&scull_pc_device.sem);
+}
+
+static int scull_pc_seq_show(struct seq_file *s, void *v)
+{
+	struct scull_pc_rec *rec = v;
+
+	seq_printf(s, "%llu cpu%u %u bytes\n", rec->ts, rec->cpu, rec->len);
+	return 0;
+}
+
+static struct seq_operations scull_pc_seq_ops = {
+	.start = scull_pc_seq_start,
+	.next  = scull_pc_seq_next,
+	.stop  = scull_pc_seq_stop,
+	.show  = scull_pc_seq_show
+};
+
+static int scullpcpu_proc_open(struct inode *inode, struct file *file)
+{
+	return seq_open_private(file, &scull_pc_seq_ops,
+			sizeof(struct scull_pc_seq) +
+			nr_cpu_ids * sizeof(struct scull_pc_pos));
+}
+
+static struct file_operations scullpcpu_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scullpcpu_proc_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release_private
+};
+
+#endif
+
+
+struct file_operations scull_pc_fops = {
+	.owner =	THIS_MODULE,
+	.llseek =	no_llseek,
+	.read =		scull_pc_read,
+	.write =	scull_pc_write,
+	.open =		scull_pc_open,
+	.release =	scull_pc_release,
+};
+
+
+/*
+ * Init and cleanup, called by main.c like the other friend devices.
+ */
+int scull_pc_init(dev_t firstdev)
+{
+	struct scull_pc_dev *dev = &scull_pc_device;
+	int result, cpu;
+
+	result = register_chrdev_region(firstdev, 1, "scullpcpu");
+	if (result < 0) {
+		printk(KERN_NOTICE "Unable to get scullpcpu region, error %d\n", result);
+		return 0;
+	}
+	dev->cpus = alloc_percpu(struct scull_pc_cpu);
+	if (!dev->cpus)
+		goto fail_region;
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu_ptr(dev->cpus, cpu)->lock);
+	if (percpu_init_rwsem(&dev->sem))
+		goto fail_percpu;
+
+	cdev_init(&dev->cdev, &scull_pc_fops);
+	dev->cdev.owner = THIS_MODULE;
+	result = cdev_add(&dev->cdev, firstdev, 1);
+	if (result) {
+		printk(KERN_NOTICE "Error %d adding scullpcpu\n", result);
+		goto fail_rwsem;
+	}
+	scull_pc_devno = firstdev;
+#ifdef SCULL_DEBUG
+	proc_create("scullpcpu", 0, NULL, proc_ops_wrapper(&scullpcpu_proc_ops,scullpcpu_pops));
+#endif
+	return 1;
+
+  fail_rwsem:
+	percpu_free_rwsem(&dev->sem);
+  fail_percpu:
+	free_percpu(dev->cpus);
+	dev->cpus = NULL;
+  fail_region:
+	unregister_chrdev_region(firstdev, 1);
+	return 0;
+}
+
+/*
+ * This is called by cleanup_module or on failure.
+ * It is required to never fail, even if nothing was initialized first
+ */
+void scull_pc_cleanup(void)
+{
+	struct scull_pc_dev *dev = &scull_pc_device;
+
+	if (!dev->cpus)
+		return; /* nothing else to release */
+#ifdef SCULL_DEBUG
+	remove_proc_entry("scullpcpu", NULL);
+#endif
+	cdev_del(&dev->cdev);
+	scull_pc_trim(dev);
+	percpu_free_rwsem(&dev->sem);
+	free_percpu(dev->cpus);
+	dev->cpus = NULL;
+	unregister_chrdev_region(scull_pc_devno, 1);
+}
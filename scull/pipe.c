@@ -30,8 +30,13 @@
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
 
 #include "proc_ops_version.h"
+#include "splice_version.h"
 
 #include "scull.h"		/* local definitions */
 
@@ -44,20 +49,236 @@ struct scull_pipe {
         struct fasync_struct *async_queue; /* asynchronous readers */
         struct mutex lock;              /* mutual exclusion mutex */
         struct cdev cdev;                  /* Char device structure */
+        int ring;                          /* lock-free single reader/writer */
+        struct scull_p_ring *ctl;          /* ring: indices, mappable */
+        struct file *reader, *writer;      /* ring: the two sides */
+        int record;                        /* one write() is one message */
 };
 
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_ring;		/* bitmask of devices in ring mode */
+static int scull_p_record;		/* bitmask of devices in record mode */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_ring, int, 0);
+module_param(scull_p_record, int, 0);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
+static int scull_getreaddata(struct scull_pipe *dev, int nonblock);
+struct file_operations scull_pipe_fops;
+/* Both O_NONBLOCK and RWF_NOWAIT mean "don't sleep" */
+static inline int scull_p_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		(iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * The ring mode. When a device has a single reader and a single writer,
+ * the two sides don't need to exclude each other: the reader only
+ * moves "head", the writer only moves "tail", and each publishes its
+ * index with release semantics after touching the data. The indices
+ * run free and the buffer size is a power of two, so "tail - head" is
+ * the amount of data and no slot is wasted to tell full from empty.
+ *
+ * The first file that reads becomes the reader, the first that writes
+ * becomes the writer; anybody else gets -EBUSY. Opening is not
+ * restricted, as a process that maps the ring (see scull_p_mmap) takes
+ * one of the two roles in user space without calling read or write.
+ *
+ * A side only sleeps after seeing the ring empty (or full), so the
+ * peer only needs to wake it when the wait queue is not empty; the
+ * barrier in wq_has_sleeper() pairs with the one in prepare_to_wait().
+ * The rd_wait/wr_wait words tell the same to a peer in user space.
+ */
+static int scull_p_ring_open(struct scull_pipe *dev, struct file *filp)
+{
+	unsigned int size;
+
+	if (dev->ctl)
+		return 0;
+
+	size = roundup_pow_of_two(max_t(int, scull_p_buffer, PAGE_SIZE));
+	/* control page first, then the data: zeroed and mappable */
+	dev->ctl = vmalloc_user(PAGE_SIZE + size);
+	if (!dev->ctl)
+		return -ENOMEM;
+	dev->ctl->size = dev->buffersize = size;
+	dev->buffer = (char *)dev->ctl + PAGE_SIZE;
+	dev->end = dev->buffer + dev->buffersize;
+	return 0;
+}
+
+/* Release the buffer (and the control page, for a ring) */
+static void scull_p_free(struct scull_pipe *dev)
+{
+	if (dev->ring)
+		vfree(dev->ctl);
+	else
+		kfree(dev->buffer);
+	dev->ctl = NULL;
+	dev->buffer = NULL; /* the other fields are not checked on open */
+}
+
+/* Claim the reader or writer role for this file */
+static int scull_p_ring_claim(struct file **owner, struct file *filp)
+{
+	if (likely(READ_ONCE(*owner) == filp))
+		return 0;
+	return cmpxchg(owner, NULL, filp) ? -EBUSY : 0;
+}
+
+static ssize_t scull_p_ring_read(struct scull_pipe *dev, struct kiocb *iocb,
+		struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_p_ring *ctl = dev->ctl;
+	unsigned int size = dev->buffersize, head, tail, off, first;
+	size_t count = iov_iter_count(to), copied;
+
+	if (scull_p_ring_claim(&dev->reader, filp))
+		return -EBUSY;
+	head = ctl->head;
+	tail = smp_load_acquire(&ctl->tail);
+	while (tail == head) { /* nothing to read */
+		if (scull_p_nonblock(iocb))
+			return -EAGAIN;
+		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+		WRITE_ONCE(ctl->rd_wait, 1);
+		smp_mb(); /* pairs with the producer's, after moving tail */
+		if (wait_event_interruptible(dev->inq,
+				(tail = smp_load_acquire(&ctl->tail)) != head)) {
+			WRITE_ONCE(ctl->rd_wait, 0);
+			return -ERESTARTSYS;
+		}
+		WRITE_ONCE(ctl->rd_wait, 0);
+	}
+
+	/* the indices are in a shared page: don't trust them blindly */
+	if (tail - head > size)
+		return -EIO;
+	/* copy what is there, in two pieces if it wraps */
+	count = min(count, (size_t)(tail - head));
+	off = head & (size - 1);
+	first = min_t(size_t, count, size - off);
+	copied = copy_to_iter(dev->buffer + off, first, to);
+	if (copied == first)
+		copied += copy_to_iter(dev->buffer, count - first, to);
+	if (!copied && count)
+		return -EFAULT;
+	count = copied;
+	smp_store_release(&ctl->head, head + count);
+
+	/* the writer may be waiting for space */
+	if (wq_has_sleeper(&dev->outq))
+		wake_up_interruptible(&dev->outq);
+	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
+	return count;
+}
+
+static ssize_t scull_p_ring_write(struct scull_pipe *dev, struct kiocb *iocb,
+		struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_p_ring *ctl = dev->ctl;
+	unsigned int size = dev->buffersize, head, tail, off, first;
+	size_t count = iov_iter_count(from), copied;
+
+	if (scull_p_ring_claim(&dev->writer, filp))
+		return -EBUSY;
+	tail = ctl->tail;
+	head = smp_load_acquire(&ctl->head);
+	while (tail - head == size) { /* full */
+		if (scull_p_nonblock(iocb))
+			return -EAGAIN;
+		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
+		WRITE_ONCE(ctl->wr_wait, 1);
+		smp_mb(); /* pairs with the consumer's, after moving head */
+		if (wait_event_interruptible(dev->outq,
+				tail - (head = smp_load_acquire(&ctl->head)) != size)) {
+			WRITE_ONCE(ctl->wr_wait, 0);
+			return -ERESTARTSYS;
+		}
+		WRITE_ONCE(ctl->wr_wait, 0);
+	}
+
+	if (tail - head > size)
+		return -EIO; /* see scull_p_ring_read */
+	count = min(count, (size_t)(size - (tail - head)));
+	off = tail & (size - 1);
+	first = min_t(size_t, count, size - off);
+	copied = copy_from_iter(dev->buffer + off, first, from);
+	if (copied == first)
+		copied += copy_from_iter(dev->buffer, count - first, from);
+	if (!copied && count)
+		return -EFAULT;
+	count = copied;
+	smp_store_release(&ctl->tail, tail + count);
+
+	/* the reader may be waiting for data */
+	if (wq_has_sleeper(&dev->inq))
+		wake_up_interruptible(&dev->inq);
+	/* and signal asynchronous readers if we made it non-empty */
+	if (dev->async_queue && tail == head)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
+	return count;
+}
+
+static unsigned int scull_p_ring_poll(struct scull_pipe *dev,
+		struct file *filp, poll_table *wait)
+{
+	struct scull_p_ring *ctl = dev->ctl;
+	unsigned int used, mask = 0;
+
+	poll_wait(filp, &dev->inq,  wait);
+	poll_wait(filp, &dev->outq, wait);
+	used = smp_load_acquire(&ctl->tail) - smp_load_acquire(&ctl->head);
+	if (used)
+		mask |= POLLIN | POLLRDNORM;	/* readable */
+	if (used != dev->buffersize)
+		mask |= POLLOUT | POLLWRNORM;	/* writable */
+	return mask;
+}
+
+/*
+ * The doorbell: a peer working in the mapped ring tells us it moved
+ * its index, so whoever sleeps on the other side must look again.
+ */
+long scull_p_wake(struct file *filp)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	if (filp->f_op != &scull_pipe_fops || !dev->ring)
+		return -ENOTTY;
+	wake_up_interruptible(&dev->inq);
+	wake_up_interruptible(&dev->outq);
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	return 0;
+}
+
+/*
+ * Map the control page and the ring. Both are vmalloc()ed memory
+ * set up for user mappings, so remap_vmalloc_range does it all; the
+ * mapping holds the file, so the ring can't go away under it.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	if (!dev->ring || !dev->ctl)
+		return -ENODEV;
+	return remap_vmalloc_range(vma, dev->ctl, vma->vm_pgoff);
+}
+
 /*
  * Open and close
  */
@@ -72,6 +293,15 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
+	if (dev->ring) {
+		int result = scull_p_ring_open(dev, filp);
+
+		if (result) {
+			mutex_unlock(&dev->lock);
+			return result;
+		}
+		goto opened;
+	}
 	if (!dev->buffer) {
 		/* allocate the buffer */
 		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
@@ -84,6 +314,7 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 	dev->end = dev->buffer + dev->buffersize;
 	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
+  opened:
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
 		dev->nreaders++;
@@ -107,10 +338,10 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 		dev->nreaders--;
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
-	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer = NULL; /* the other fields are not checked on open */
-	}
+	cmpxchg(&dev->reader, filp, NULL); /* ring roles, if we had one */
+	cmpxchg(&dev->writer, filp, NULL);
+	if (dev->nreaders + dev->nwriters == 0)
+		scull_p_free(dev);
 	mutex_unlock(&dev->lock);
 	return 0;
 }
@@ -120,17 +351,165 @@ static int scull_p_release(struct inode *inode, struct file *filp)
  * Data management: read and write
  */
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * The record mode. Each write() is a message, stored in the circular
+ * buffer as its length (a u32) followed by the payload, and it is only
+ * accepted whole: the writer waits for room for all of it. A read()
+ * returns one message; whatever doesn't fit in the buffer is dropped,
+ * as with datagram sockets. SCULL_P_IOCRECVMMSG dequeues many
+ * messages with a single lock round trip and a single wakeup.
+ *
+ * These helpers move data in and out of the circular buffer across
+ * the wrap point. All of them are called with the mutex held, and
+ * none moves rp or wp: the caller commits once all is well.
+ */
+static char *scull_p_advance(struct scull_pipe *dev, char *ptr, size_t n)
+{
+	ptr += n;
+	if (ptr >= dev->end)
+		ptr -= dev->buffersize;
+	return ptr;
+}
+
+static void scull_p_peek(struct scull_pipe *dev, char *from, void *to,
+		size_t n)
+{
+	size_t first = min_t(size_t, n, dev->end - from);
+
+	memcpy(to, from, first);
+	memcpy(to + first, dev->buffer, n - first);
+}
+
+static void scull_p_poke(struct scull_pipe *dev, char *to, const void *from,
+		size_t n)
+{
+	size_t first = min_t(size_t, n, dev->end - to);
+
+	memcpy(to, from, first);
+	memcpy(dev->buffer, from + first, n - first);
+}
+
+static size_t scull_p_to_iter(struct scull_pipe *dev, char *from, size_t n,
+		struct iov_iter *to)
+{
+	size_t first = min_t(size_t, n, dev->end - from);
+	size_t copied = copy_to_iter(from, first, to);
+
+	if (copied == first)
+		copied += copy_to_iter(dev->buffer, n - first, to);
+	return copied;
+}
+
+static size_t scull_p_from_iter(struct scull_pipe *dev, char *to, size_t n,
+		struct iov_iter *from)
+{
+	size_t first = min_t(size_t, n, dev->end - to);
+	size_t copied = copy_from_iter(to, first, from);
+
+	if (copied == first)
+		copied += copy_from_iter(dev->buffer, n - first, from);
+	return copied;
+}
+
+/* Dequeue one message into "to", returning its length or -EFAULT */
+static ssize_t scull_p_rec_get(struct scull_pipe *dev, struct iov_iter *to,
+		u32 *len)
+{
+	char *data = scull_p_advance(dev, dev->rp, sizeof(u32));
+	size_t count;
+
+	scull_p_peek(dev, dev->rp, len, sizeof(u32));
+	count = min_t(size_t, *len, iov_iter_count(to));
+	if (scull_p_to_iter(dev, data, count, to) != count)
+		return -EFAULT; /* leave it there */
+	dev->rp = scull_p_advance(dev, data, *len);
+	return count;
+}
+
+/* Read one message: there is one, and the caller holds the mutex */
+static ssize_t scull_p_rec_read(struct scull_pipe *dev, struct iov_iter *to)
+{
+	u32 len;
+
+	return scull_p_rec_get(dev, to, &len);
+}
+
+/* Write one message: there is room for it, and the caller holds the mutex */
+static ssize_t scull_p_rec_write(struct scull_pipe *dev,
+		struct iov_iter *from, size_t count)
+{
+	char *data = scull_p_advance(dev, dev->wp, sizeof(u32));
+	u32 len = count;
+
+	if (scull_p_from_iter(dev, data, count, from) != count)
+		return -EFAULT; /* nothing is committed */
+	scull_p_poke(dev, dev->wp, &len, sizeof(u32));
+	dev->wp = scull_p_advance(dev, data, count);
+	return count;
+}
+
+/*
+ * SCULL_P_IOCRECVMMSG: receive up to "vlen" messages, one per iovec,
+ * storing the length of each (before any truncation) in "lens". It
+ * waits for the first message only, and returns how many it got.
+ */
+long scull_p_recvmmsg(struct file *filp, unsigned long arg)
 {
 	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_mmsg mm;
+	struct iovec iov;
+	struct iov_iter to;
+	long retval = 0;
+	ssize_t result;
+	u32 len;
+
+	if (filp->f_op != &scull_pipe_fops || !dev->record)
+		return -ENOTTY;
+	if (copy_from_user(&mm, (void __user *)arg, sizeof(mm)))
+		return -EFAULT;
+	if (mm.vlen == 0)
+		return 0;
+	if (mm.vlen > UIO_MAXIOV)
+		mm.vlen = UIO_MAXIOV;
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
+	result = scull_getreaddata(dev, (filp->f_flags & O_NONBLOCK) ||
+			(mm.flags & SCULL_P_MSG_DONTWAIT));
+	if (result)
+		return result; /* scull_getreaddata released the mutex */
 
+	while (retval < mm.vlen && dev->rp != dev->wp) {
+		if (copy_from_user(&iov, (void __user *)(mm.iov + retval),
+				sizeof(iov))) {
+			result = -EFAULT;
+			break;
+		}
+		iov_iter_init(&to, READ, &iov, 1, iov.iov_len);
+		result = scull_p_rec_get(dev, &to, &len);
+		if (result < 0)
+			break;
+		if (put_user(len, (u32 __user *)(mm.lens + retval))) {
+			result = -EFAULT; /* the message is gone, alas */
+			break;
+		}
+		retval++;
+	}
+	mutex_unlock(&dev->lock);
+
+	if (retval)
+		wake_up_interruptible(&dev->outq);
+	PDEBUG("\"%s\" did receive %li messages\n", current->comm, retval);
+	return retval ? retval : result;
+}
+
+/* Wait for data to read; caller must hold the device mutex.  On
+ * error the mutex will be released before returning. */
+static int scull_getreaddata(struct scull_pipe *dev, int nonblock)
+{
 	while (dev->rp == dev->wp) { /* nothing to read */
 		mutex_unlock(&dev->lock); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
+		if (nonblock)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
 		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
@@ -139,15 +518,43 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
 		if (mutex_lock_interruptible(&dev->lock))
 			return -ERESTARTSYS;
 	}
+	return 0;
+}
+
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_pipe *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to), copied;
+	int result;
+
+	if (dev->ring)
+		return scull_p_ring_read(dev, iocb, to);
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+
+	result = scull_getreaddata(dev, scull_p_nonblock(iocb));
+	if (result)
+		return result; /* scull_getreaddata released the mutex */
+	if (dev->record) {
+		result = scull_p_rec_read(dev, to);
+		mutex_unlock(&dev->lock);
+		if (result >= 0)
+			wake_up_interruptible(&dev->outq);
+		return result;
+	}
+
 	/* ok, data is there, return something */
 	if (dev->wp > dev->rp)
 		count = min(count, (size_t)(dev->wp - dev->rp));
 	else /* the write pointer has wrapped, return data up to dev->end */
 		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
+	copied = copy_to_iter(dev->rp, count, to);
+	if (!copied && count) {
 		mutex_unlock (&dev->lock);
 		return -EFAULT;
 	}
+	count = copied;
 	dev->rp += count;
 	if (dev->rp == dev->end)
 		dev->rp = dev->buffer; /* wrapped */
@@ -161,17 +568,18 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
 
 /* Wait for space for writing; caller must hold device semaphore.  On
  * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+static int scull_getwritespace(struct scull_pipe *dev, struct kiocb *iocb,
+		int need)
 {
-	while (spacefree(dev) == 0) { /* full */
+	while (spacefree(dev) < need) { /* full */
 		DEFINE_WAIT(wait);
 		
 		mutex_unlock(&dev->lock);
-		if (filp->f_flags & O_NONBLOCK)
+		if (scull_p_nonblock(iocb))
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (spacefree(dev) < need)
 			schedule();
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
@@ -190,19 +598,32 @@ static int spacefree(struct scull_pipe *dev)
 	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from), copied;
 	int result;
 
+	if (dev->ring)
+		return scull_p_ring_write(dev, iocb, from);
+	if (dev->record && count > dev->buffersize - 1 - sizeof(u32))
+		return -EMSGSIZE; /* would never fit */
+
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
 
-	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	/* Make sure there's space to write (the whole message, if a record) */
+	result = scull_getwritespace(dev, iocb,
+			dev->record ? sizeof(u32) + count : 1);
 	if (result)
 		return result; /* scull_getwritespace called up(&dev->sem) */
+	if (dev->record) {
+		result = scull_p_rec_write(dev, from, count);
+		mutex_unlock(&dev->lock);
+		if (result < 0)
+			return result;
+		goto written;
+	}
 
 	/* ok, space is there, accept something */
 	count = min(count, (size_t)spacefree(dev));
@@ -210,16 +631,19 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
 	else /* the write pointer has wrapped, fill up to rp-1 */
 		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
+	PDEBUG("Going to accept %li bytes to %p\n", (long)count, dev->wp);
+	copied = copy_from_iter(dev->wp, count, from);
+	if (!copied && count) {
 		mutex_unlock(&dev->lock);
 		return -EFAULT;
 	}
+	count = copied;
 	dev->wp += count;
 	if (dev->wp == dev->end)
 		dev->wp = dev->buffer; /* wrapped */
 	mutex_unlock(&dev->lock);
 
+  written:
 	/* finally, awake any reader */
 	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
 
@@ -235,6 +659,9 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 	struct scull_pipe *dev = filp->private_data;
 	unsigned int mask = 0;
 
+	if (dev->ring)
+		return scull_p_ring_poll(dev, filp, wait);
+
 	/*
 	 * The buffer is circular; it is considered full
 	 * if "wp" is right behind "rp" and empty if the
@@ -281,7 +708,13 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
 		seq_printf(s, "\nDevice %i: %p\n", i, p);
 /*		seq_printf(s, "   Queues: %p %p\n", p->inq, p->outq);*/
 		seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
+		if (p->ring)
+			seq_printf(s, "   ring: head %u   tail %u\n",
+					p->ctl ? p->ctl->head : 0,
+					p->ctl ? p->ctl->tail : 0);
+		else
+			seq_printf(s, "   rp %p   wp %p%s\n", p->rp, p->wp,
+					p->record ? "   (records)" : "");
 		seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
 		mutex_unlock(&p->lock);
 	}
@@ -312,10 +745,13 @@ static struct file_operations scullpipe_proc_ops = {
 struct file_operations scull_pipe_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =	no_llseek,
-	.read =		scull_p_read,
-	.write =	scull_p_write,
+	.read_iter =	scull_p_read_iter,
+	.write_iter =	scull_p_write_iter,
+	.splice_read =	copy_splice_read,
+	.splice_write =	iter_file_splice_write,
 	.poll =		scull_p_poll,
 	.unlocked_ioctl = scull_ioctl,
+	.mmap =		scull_p_mmap,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -362,6 +798,10 @@ int scull_p_init(dev_t firstdev)
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		mutex_init(&scull_p_devices[i].lock);
+		scull_p_devices[i].ring = (scull_p_ring >> i) & 1;
+		/* ring devices have no record mode */
+		scull_p_devices[i].record = !scull_p_devices[i].ring &&
+			((scull_p_record >> i) & 1);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
@@ -387,7 +827,7 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		scull_p_free(scull_p_devices + i);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
@@ -60,6 +60,10 @@
  * pointer refers to a memory area of SCULL_QUANTUM bytes.
  *
  * The array (quantum-set) is SCULL_QSET long.
+ *
+ * Alternatively (scull_xarray=1) the quanta are kept in an xarray
+ * keyed by quantum number, so that finding the quantum for a given
+ * offset doesn't need to walk the list.
  */
 #ifndef SCULL_QUANTUM
 #define SCULL_QUANTUM 4000
@@ -69,6 +73,15 @@
 #define SCULL_QSET    1000
 #endif
 
+/*
+ * Readers and writers share the device semaphore, and then take one
+ * of these per-qset locks (hashed on the qset number), so only I/O
+ * touching the same quantum set is serialized.
+ */
+#ifndef SCULL_QLOCKS
+#define SCULL_QLOCKS 16
+#endif
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
  */
@@ -76,6 +89,136 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
+/*
+ * In ring mode, a scullpipe can be mapped: the first page holds this
+ * control block, the ring itself follows at offset PAGE_SIZE. The two
+ * sides exchange data by moving "head" (consumer) and "tail"
+ * (producer) with release/acquire semantics, exactly like read() and
+ * write() do. Before sleeping in poll(), a side sets its "wait" word
+ * and checks the ring again; after moving its index, the peer checks
+ * that word and rings the doorbell (SCULL_P_IOCWAKE) only if it's set.
+ * Each "wait" word is only ever written by the side that sleeps.
+ */
+struct scull_p_ring {
+	unsigned int head;	/* consumer index, free-running */
+	unsigned int rd_wait;	/* consumer is going to sleep */
+	unsigned int pad1[14];	/* keep the two sides in different lines */
+	unsigned int tail;	/* producer index, free-running */
+	unsigned int wr_wait;	/* producer is going to sleep */
+	unsigned int pad2[14];
+	unsigned int size;	/* ring size, a power of two */
+};
+
+/*
+ * In record mode, SCULL_P_IOCRECVMMSG receives up to "vlen" messages
+ * at once, one in each iovec, and stores their lengths in "lens" (a
+ * length larger than its iov_len means the message was truncated).
+ * The ioctl returns how many messages were received.
+ */
+struct scull_p_mmsg {
+	unsigned int vlen;	/* number of iovecs and lens */
+	unsigned int flags;	/* SCULL_P_MSG_DONTWAIT */
+	struct iovec *iov;	/* one buffer per message */
+	unsigned int *lens;	/* message lengths, returned */
+};
+#define SCULL_P_MSG_DONTWAIT	1	/* don't wait for the first one */
+
+/*
+ * Reading scullpcpu returns records in timestamp order, each one this
+ * header followed by "len" bytes of what a single write() stored.
+ */
+struct scull_pc_rec {
+	unsigned long long ts;	/* ktime_get_ns() at write time */
+	unsigned int len;	/* payload length */
+	unsigned int cpu;	/* the CPU whose chain it was in */
+};
+
+/*
+ * What SCULL_IOCGALLOCSTAT returns about quantum allocations since the
+ * device was last trimmed: hist[i] counts those that took less than
+ * 2^i nanoseconds (and at least half of that).
+ */
+#define SCULL_ALLOC_NAMELEN	16
+#define SCULL_HIST_BUCKETS	32
+
+struct scull_alloc_stat {
+	char name[SCULL_ALLOC_NAMELEN];	/* allocation method */
+	unsigned long long failed;	/* allocations that failed */
+	unsigned long long hist[SCULL_HIST_BUCKETS];
+};
+
+/*
+ * Where the quanta of a device are allocated (SCULL_IOCSNUMA): on the
+ * node of the writing process, on the nodes with memory in turn, or
+ * all on one node. It applies to the quanta allocated from then on.
+ */
+#define SCULL_NUMA_LOCAL	0
+#define SCULL_NUMA_INTERLEAVE	1
+#define SCULL_NUMA_BIND		2
+
+struct scull_numa {
+	int policy;		/* SCULL_NUMA_* */
+	int node;		/* the node to bind to, or interleave from */
+};
+
+/*
+ * /proc/scullstat (with SCULL_DEBUG) is an array of these, one per
+ * bare device.
+ */
+struct scull_dev_stat {
+	unsigned int qset;
+	unsigned int quantum;
+	unsigned long long size;
+	unsigned int indexed;		/* quanta in an xarray */
+	unsigned int vmas;		/* mappings */
+	unsigned long long alloc_failed;
+	unsigned long long zcount;	/* compressed quanta */
+	unsigned long long zbytes;	/* and their size */
+	unsigned long long unzips;	/* decompressions */
+	unsigned long long unzip_ns;	/* and the time they took */
+	unsigned long long dedup_hashed; /* quanta hashed after a write */
+	unsigned long long dedup_hits;	/* found to be shared */
+	unsigned long long dedup_zero;	/* found to be zeros, and freed */
+	unsigned long long dedup_saved;	/* extra users of shared quanta */
+};
+
+#ifdef __KERNEL__
+
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+
+struct scull_dev;
+
+/*
+ * A way of allocating quanta (see alloc.c). "setup" returns the state
+ * the other methods find in dev->alloc_priv, or NULL if it fails;
+ * "alloc" gets the node the quantum should be on, if any.
+ */
+struct scull_allocator {
+	const char *name;
+	int pages;		/* quanta are refcounted pages */
+	int compound;		/* and compound ones, if they can be */
+	void *(*setup)(struct scull_dev *dev);
+	void (*release)(struct scull_dev *dev);
+	void *(*alloc)(struct scull_dev *dev, int nid, gfp_t gfp);
+	void (*free)(struct scull_dev *dev, void *quantum);
+};
+
+/*
+ * Where a device gets its quantum and qset from at each trim: the
+ * parameters of the module that made it, scull itself or one of the
+ * front ends (scullc, scullp...), which their ioctls change. Front
+ * ends that count in pages give an order rather than a quantum.
+ */
+struct scull_defaults {
+	int *quantum;		/* in bytes, or */
+	int *order;		/* PAGE_SIZE << order bytes */
+	int *qset;
+};
+
+#define SCULL_MAX_ORDER	10	/* largest order taken from an ioctl */
+
 /*
  * Representation of scull quantum sets.
  */
@@ -86,14 +229,83 @@ struct scull_qset {
 
 struct scull_dev {
 	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct xarray quanta;     /* Quantum index, if "indexed" */
+	int indexed;              /* use "quanta" instead of "data" */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
+	const struct scull_defaults *defaults; /* restored by a trim */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct mutex lock;     /* mutual exclusion semaphore     */
+	struct rw_semaphore sem;  /* shared for I/O, exclusive for trim */
+	struct rw_semaphore qlock[SCULL_QLOCKS]; /* per-qset locks */
+	struct mutex alloc_lock;  /* protects growth of the qset list */
+	atomic_t vmas;            /* active mappings */
+	const struct scull_allocator *alloc; /* where quanta come from */
+	void *alloc_priv;         /* and its state, if any */
+	atomic_long_t alloc_hist[SCULL_HIST_BUCKETS]; /* allocation times */
+	atomic_long_t alloc_failed;
+	int numa_policy;          /* SCULL_NUMA_* */
+	int numa_node;            /* bound to, or last interleaved to */
+	atomic_long_t *node_quanta; /* quanta on each node */
+	struct delayed_work zwork; /* compresses cold quanta */
+	atomic_long_t zcount;     /* compressed quanta */
+	atomic_long_t zbytes;     /* and their size */
+	atomic_long_t unzips;     /* decompressions */
+	atomic_long_t unzip_ns;   /* and the time they took */
+	struct hlist_head *dedup; /* shared quanta, by hash */
+	struct mutex dedup_lock;  /* protects it, and their counts */
+	atomic_long_t dedup_hashed; /* quanta hashed after a write */
+	atomic_long_t dedup_hits; /* that turned out to be shared */
+	atomic_long_t dedup_zero; /* that were all zeros, and freed */
+	atomic_long_t dedup_saved; /* extra users of shared quanta */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
+/*
+ * Quanta can be mapped or spliced only if they are made of pages the
+ * kernel refcounts (compound pages, or vmalloc()ed ones), and the
+ * quantum is a whole number of pages.
+ */
+#define scull_paged(dev)	((dev)->alloc->pages && PAGE_ALIGNED((dev)->quantum))
+
+/* The page holding byte "addr" of such a quantum */
+static inline struct page *scull_qpage(void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		return vmalloc_to_page(addr);
+	return virt_to_page(addr);
+}
+
+/*
+ * Compressed quanta are tagged pointers in the xarray; the marks tell
+ * the ones used recently, and those not worth compressing.
+ */
+#define SCULL_ZTAG		1
+#define scull_zipped(q)		(xa_pointer_tag(q) == SCULL_ZTAG)
+#define SCULL_HOT		XA_MARK_0
+#define SCULL_NOZIP		XA_MARK_1
+
+/*
+ * A quantum with the same contents in several places of the device;
+ * it's pointed to by a tagged entry in each of them.
+ */
+struct scull_shared {
+	struct hlist_node hnode;  /* in the device's table */
+	u64 hash;
+	int count;                /* entries pointing here */
+	void *quantum;
+};
+#define SCULL_STAG		3
+#define scull_shared(q)		(xa_pointer_tag(q) == SCULL_STAG)
+
+/* The data of a quantum that may be shared, to read it */
+static inline void *scull_qdata(void *entry)
+{
+	if (scull_shared(entry))
+		return ((struct scull_shared *)xa_untag_pointer(entry))->quantum;
+	return entry;
+}
+
 /*
  * Split minors in two parts
  */
@@ -108,6 +320,15 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_xarray;
+
+extern int scull_arena;		/* alloc.c */
+extern int scull_numa;
+extern int scull_node;
+extern unsigned int scull_pool_max;
+extern int scull_compress;	/* compress.c */
+extern int scull_dedup;		/* dedup.c */
+extern const struct scull_allocator *scull_alloc_default;
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -120,15 +341,58 @@ int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
+int     scull_pc_init(dev_t dev);
+void    scull_pc_cleanup(void);
 
+void    scull_dev_init(struct scull_dev *dev,
+		       const struct scull_defaults *defaults);
+int     scull_default_quantum(struct scull_dev *dev);
 int     scull_trim(struct scull_dev *dev);
+void   *scull_get_quantum(struct scull_dev *dev, unsigned long index);
+void   *scull_alloc_quantum(struct scull_dev *dev, unsigned long index);
+const struct scull_allocator *scull_alloc_pick(const char *list, int n);
+void   *scull_new_quantum(struct scull_dev *dev);
+void    scull_free_quantum(struct scull_dev *dev, void *quantum);
+void    scull_alloc_release(struct scull_dev *dev);
+void    scull_alloc_trim(struct scull_dev *dev);
+long    scull_alloc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+void    scull_alloc_show(struct seq_file *s, struct scull_dev *dev);
+void    scull_alloc_init(void);
+void    scull_alloc_cleanup(void);
+int     scull_numa_check(int policy, int node);
+void   *scull_unzip(struct scull_dev *dev, unsigned long index);
+void   *scull_unzip_shared(struct scull_dev *dev, unsigned long index,
+			   struct rw_semaphore *qlock);
+void    scull_zfree(struct scull_dev *dev, void *entry);
+void    scull_touch(struct scull_dev *dev, unsigned long index, int write);
+void    scull_zip_start(struct scull_dev *dev);
+void    scull_zip_stop(struct scull_dev *dev);
+void    scull_zip_show(struct seq_file *s, struct scull_dev *dev);
+void    scull_zip_init(void);
+void    scull_zip_cleanup(void);
+void    scull_dedup_quantum(struct scull_dev *dev, unsigned long index);
+void   *scull_unshare(struct scull_dev *dev, unsigned long index);
+void    scull_dedup_free(struct scull_dev *dev, void *entry);
+void    scull_dedup_trim(struct scull_dev *dev);
+void    scull_dedup_show(struct seq_file *s, struct scull_dev *dev);
+struct rw_semaphore *scull_qlock(struct scull_dev *dev, unsigned long index);
+int     scull_mmap(struct file *filp, struct vm_area_struct *vma);
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos);
+int     scull_open(struct inode *inode, struct file *filp);
+int     scull_release(struct inode *inode, struct file *filp);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+			  struct pipe_inode_info *pipe, size_t len,
+			  unsigned int flags);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
+long    scull_fallocate(struct file *filp, int mode, loff_t offset,
+			loff_t len);
 long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+long    scull_p_wake(struct file *filp);
+long    scull_p_recvmmsg(struct file *filp, unsigned long arg);
+
+#endif /* __KERNEL__ */
 
 
 /*
@@ -169,8 +433,33 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+#define SCULL_P_IOCWAKE  _IO(SCULL_IOC_MAGIC,   15) /* ring doorbell */
+#define SCULL_P_IOCRECVMMSG _IOWR(SCULL_IOC_MAGIC, 16, struct scull_p_mmsg)
+
+/* Allocation method of a bare device: setting it empties the device */
+#define SCULL_IOCSALLOC     _IOW(SCULL_IOC_MAGIC, 17, char[SCULL_ALLOC_NAMELEN])
+#define SCULL_IOCGALLOCSTAT _IOR(SCULL_IOC_MAGIC, 18, struct scull_alloc_stat)
+/* NUMA placement of the quanta of a bare device */
+#define SCULL_IOCSNUMA      _IOW(SCULL_IOC_MAGIC, 19, struct scull_numa)
+#define SCULL_IOCGNUMA      _IOR(SCULL_IOC_MAGIC, 20, struct scull_numa)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 20
+
+/*
+ * A bare device also takes commands through io_uring, as
+ * IORING_OP_URING_CMD: the command is one of the ioctls above, with
+ * the argument in "arg" (a value or a pointer, as for ioctl), or one
+ * of the bulk operations below, which aren't ioctls. The result is in
+ * the completion.
+ */
+struct scull_ucmd {
+	unsigned long long arg;	/* SCULL_UCMD_COPY: the first quantum */
+	unsigned int dst;	/* SCULL_UCMD_COPY: where to copy it */
+	unsigned int count;	/* SCULL_UCMD_COPY: how many, at most */
+};
+
+#define SCULL_UCMD_TRIM	_IO(SCULL_IOC_MAGIC, 0x80) /* empty the device */
+#define SCULL_UCMD_COPY	_IO(SCULL_IOC_MAGIC, 0x81) /* copy quanta within it */
 
 #endif /* _SCULL_H_ */
@@ -0,0 +1,184 @@
+/*
+ * scullbench.c -- the same workload on each scull allocation method
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kzalloc(), kvmalloc() */
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>	/* cond_resched() */
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Load it after scull, and it runs the same rounds on a private scull
+ * device with each allocation method in turn: fill "bench_megs" of
+ * quanta, read them back, trim. The results go to the kernel log:
+ * throughput of each step, and the percentiles of the time taken by
+ * quantum allocations, as histogrammed by alloc.c. This is the core
+ * alone; misc-progs/scullbench does the same through system calls.
+ *
+ * The quantum, qset and indexing are those scull was loaded with. The
+ * "arena" method needs scull_arena to be large enough for the data.
+ */
+
+static int bench_megs = 8;
+static int bench_rounds = 10;
+static char *bench_methods = "kmalloc,cache,pages,vmalloc,arena";
+module_param(bench_megs, int, S_IRUGO);
+module_param(bench_rounds, int, S_IRUGO);
+module_param(bench_methods, charp, S_IRUGO);
+
+MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
+MODULE_LICENSE("Dual BSD/GPL");
+
+/* Upper bound, in ns, of the bucket holding "permille" of the samples */
+static u64 scullbench_pct(u64 *hist, int permille)
+{
+	u64 total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+		total += hist[i];
+	for (i = 0; i < SCULL_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum && sum * 1000 >= total * permille)
+			break;
+	}
+	return i < SCULL_HIST_BUCKETS ? 1ULL << i : 0;
+}
+
+/* Megabytes per second, for "bytes" in "ns" */
+static unsigned long scullbench_mbs(u64 bytes, u64 ns)
+{
+	return ns ? div64_u64(bytes * (NSEC_PER_SEC >> 10), ns) >> 10 : 0;
+}
+
+static int scullbench_run(struct scull_dev *dev, void *buf,
+		const struct scull_allocator *a)
+{
+	u64 hist[SCULL_HIST_BUCKETS] = { 0 }, failed = 0;
+	u64 t, tw = 0, tr = 0, tt = 0, bytes;
+	unsigned long i, nr;
+	void *quantum;
+	int r, j, retval = 0;
+
+	dev->alloc = a;
+	nr = DIV_ROUND_UP((unsigned long)bench_megs << 20, dev->quantum);
+	bytes = (u64)nr * dev->quantum;
+
+	/* nobody else sees this device, the semaphore is for the trim */
+	down_write(&dev->sem);
+	for (r = 0; r < bench_rounds && !retval; r++) {
+		t = ktime_get_ns();
+		for (i = 0; i < nr; i++) {
+			quantum = scull_alloc_quantum(dev, i);
+			if (!quantum) {
+				retval = -ENOMEM;
+				break;
+			}
+			memcpy(quantum, buf, dev->quantum);
+			cond_resched();
+		}
+		dev->size = i * dev->quantum;
+		tw += ktime_get_ns() - t;
+
+		t = ktime_get_ns();
+		for (i = 0; i < dev->size / dev->quantum; i++) {
+			quantum = scull_get_quantum(dev, i);
+			memcpy(buf, scull_qdata(quantum), dev->quantum);
+			cond_resched();
+		}
+		tr += ktime_get_ns() - t;
+
+		/* the trim starts the statistics over */
+		for (j = 0; j < SCULL_HIST_BUCKETS; j++)
+			hist[j] += atomic_long_read(&dev->alloc_hist[j]);
+		failed += atomic_long_read(&dev->alloc_failed);
+		t = ktime_get_ns();
+		scull_trim(dev);
+		tt += ktime_get_ns() - t;
+	}
+	scull_alloc_release(dev);
+	up_write(&dev->sem);
+
+	if (retval) {
+		printk(KERN_WARNING "scullbench: %-8s out of memory in round %i\n",
+				a->name, r);
+		return retval;
+	}
+	printk(KERN_INFO "scullbench: %-8s write %6lu MB/s, read %6lu MB/s, "
+			"trim %6llu us, alloc p50 %6llu p90 %6llu p99 %6llu "
+			"max %8llu ns, %llu failed\n", a->name,
+			scullbench_mbs(bytes * r, tw), scullbench_mbs(bytes * r, tr),
+			div_u64(tt, r * NSEC_PER_USEC),
+			scullbench_pct(hist, 500), scullbench_pct(hist, 900),
+			scullbench_pct(hist, 990), scullbench_pct(hist, 1000),
+			failed);
+	return 0;
+}
+
+static int __init scullbench_init(void)
+{
+	const struct scull_allocator *a;
+	struct scull_dev *dev;
+	void *buf = NULL;
+	const char *p;
+	int n, nr, err, retval = -ENOMEM;
+
+	if (bench_megs <= 0 || bench_rounds <= 0)
+		return -EINVAL;
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		goto out;
+	scull_dev_init(dev, NULL);
+	buf = kvmalloc(dev->quantum, GFP_KERNEL);
+	if (!buf)
+		goto out;
+	memset(buf, 0x5a, dev->quantum);
+
+	/* one run per entry of the list, the first error is returned */
+	for (nr = 1, p = bench_methods ?: ""; (p = strchr(p, ',')); p++)
+		nr++;
+	retval = 0;
+	for (n = 0; n < nr; n++) {
+		a = scull_alloc_pick(bench_methods, n);
+		if (!a) {
+			printk(KERN_WARNING "scullbench: bad method %i in \"%s\"\n",
+					n, bench_methods);
+			err = -EINVAL;
+		} else
+			err = scullbench_run(dev, buf, a);
+		if (err && !retval)
+			retval = err;
+	}
+
+  out:
+	kvfree(buf);
+	kfree(dev);
+	return retval;
+}
+
+static void __exit scullbench_exit(void)
+{
+}
+
+module_init(scullbench_init);
+module_exit(scullbench_exit);
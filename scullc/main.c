@@ -26,13 +26,10 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
-#include <linux/aio.h>
 #include <linux/uaccess.h>
-#include <linux/uio.h>		/* struct iovec */
-#include <linux/version.h>
-#include <linux/mutex.h>
-#include "scull-shared/scull-async.h"
+#include <linux/mm.h>
 #include "scullc.h"		/* local definitions */
+#include "scull-shared/scull-async.h"
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
 
@@ -48,16 +45,18 @@ module_param(scullc_quantum, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct scullc_dev *scullc_devices; /* allocated in scullc_init */
-
-int scullc_trim(struct scullc_dev *dev);
-void scullc_cleanup(void);
-
-/* declare one cache pointer: use it for all devices */
-struct kmem_cache *scullc_cache;
-
+struct scull_dev *scullc_devices; /* allocated in scullc_init */
 
+/*
+ * Everything else is the scull core's: a trim gives a device these
+ * parameters, which the ioctls below change.
+ */
+static const struct scull_defaults scullc_defaults = {
+	.quantum =  &scullc_quantum,
+	.qset =     &scullc_qset,
+};
 
+void scullc_cleanup(void);
 
 
 #ifdef SCULLC_USE_PROC /* don't waste space if unused */
@@ -65,37 +64,19 @@ struct kmem_cache *scullc_cache;
  * The proc filesystem: function to read and entry
  */
 
-/* FIXME: Do we need this here??  It be ugly  */
 int scullc_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, quantum, qset;
-	int limit = m->size - 80; /* Don't print more than this */
-	struct scullc_dev *d;
+	struct scull_dev *d;
+	int i;
 
 	for(i = 0; i < scullc_devs; i++) {
 		d = &scullc_devices[i];
-		if (mutex_lock_interruptible (&d->lock))
+		if (down_read_killable(&d->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		quantum=d->quantum;
-		seq_printf(m,"\nDevice %i: qset %i, quantum %i, sz %li\n",
-				i, qset, quantum, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
-			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
-			if (m->count > limit)
-				goto out;
-			if (d->data && !d->next) /* dump only the last item - save space */
-				for (j = 0; j < qset; j++) {
-					if (d->data[j])
-						seq_printf(m,"    % 4i:%8p\n",j,d->data[j]);
-					if (m->count > limit)
-						goto out;
-				}
-		}
-	  out:
-		mutex_unlock (&scullc_devices[i].lock);
-		if (m->count > limit)
-			break;
+		seq_printf(m,"\nDevice %i: qset %i, q %i, sz %li\n",
+				i, d->qset, d->quantum, d->size);
+		scull_alloc_show(m, d);
+		up_read(&d->sem);
 	}
 	return 0;
 }
@@ -116,158 +97,22 @@ static struct file_operations scullc_proc_ops = {
 #endif /* SCULLC_USE_PROC */
 
 /*
- * Open and close
+ * Open: get ready for asynchronous I/O, the rest is scull_open
  */
 
 int scullc_open (struct inode *inode, struct file *filp)
 {
-	struct scullc_dev *dev; /* device information */
-
-	/*  Find the device */
-	dev = container_of(inode->i_cdev, struct scullc_dev, cdev);
-
-    	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible (&dev->lock))
-			return -ERESTARTSYS;
-		scullc_trim(dev); /* ignore errors */
-		mutex_unlock (&dev->lock);
-	}
+	int retval;
 
-	/* and use filp->private_data to point to the device data */
-	filp->private_data = dev;
-
-	return 0;          /* success */
-}
-
-int scullc_release (struct inode *inode, struct file *filp)
-{
-	return 0;
+	retval = scull_async_open(filp);
+	if (retval)
+		return retval;
+	return scull_open(inode, filp);
 }
 
 /*
- * Follow the list 
- */
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullc_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullc_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
- */
-
-ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct scullc_dev *dev = filp->private_data; /* the first listitem */
-	struct scullc_dev *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible (&dev->lock))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullc_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	mutex_unlock (&dev->lock);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock (&dev->lock);
-	return retval;
-}
-
-
-
-ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct scullc_dev *dev = filp->private_data;
-	struct scullc_dev *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (mutex_lock_interruptible (&dev->lock))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullc_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using the memory cache */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, scullc_quantum);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock (&dev->lock);
-	return count;
-
-  nomem:
-	mutex_unlock (&dev->lock);
-	return retval;
-}
-
-/*
- * The ioctl() implementation
+ * The ioctl() implementation: the quantum and qset are ours, the
+ * allocation commands of scull go to the core.
  */
 
 long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
@@ -275,6 +120,9 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 
 	int err = 0, ret = 0, tmp;
 
+	if (_IOC_TYPE(cmd) == SCULL_IOC_MAGIC)
+		return scull_alloc_ioctl(filp, cmd, arg);
+
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLC_IOC_MAGIC) return -ENOTTY;
 	if (_IOC_NR(cmd) > SCULLC_IOC_MAXNR) return -ENOTTY;
@@ -360,86 +208,30 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
-/*
- * The "extended" operations
- */
-
-loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
-{
-	struct scullc_dev *dev = filp->private_data;
-	long newpos;
-
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
 
 /*
- * The fops
+ * The fops: all of them but open and ioctl are the core's
  */
 
 struct file_operations scullc_fops = {
 	.owner =     THIS_MODULE,
-	.llseek =    scullc_llseek,
-	.read =	     scullc_read,
-	.write =     scullc_write,
+	.llseek =    scull_llseek,
+	.read_iter = scull_async_read_iter,
+	.write_iter = scull_async_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scullc_ioctl,
+	.fallocate = scull_fallocate,
+	.mmap =	     scull_mmap,
 	.open =	     scullc_open,
-	.release =   scullc_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.release =   scull_release,
 };
 
-int scullc_trim(struct scullc_dev *dev)
-{
-	struct scullc_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
-
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					kmem_cache_free(scullc_cache, dptr->data[i]);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = scullc_qset;
-	dev->quantum = scullc_quantum;
-	dev->next = NULL;
-	return 0;
-}
-
 
-static void scullc_setup_cdev(struct scullc_dev *dev, int index)
+static void scullc_setup_cdev(struct scull_dev *dev, int index)
 {
 	int err, devno = MKDEV(scullc_major, index);
-    
+
 	cdev_init(&dev->cdev, &scullc_fops);
 	dev->cdev.owner = THIS_MODULE;
 	err = cdev_add (&dev->cdev, devno, 1);
@@ -458,7 +250,7 @@ int scullc_init(void)
 {
 	int result, i;
 	dev_t dev = MKDEV(scullc_major, 0);
-	
+
 	/*
 	 * Register your major, and accept a dynamic number.
 	 */
@@ -471,33 +263,27 @@ int scullc_init(void)
 	if (result < 0)
 		return result;
 
-	
-	/* 
+
+	/*
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
 	 */
-	scullc_devices = kmalloc(scullc_devs*sizeof (struct scullc_dev), GFP_KERNEL);
+	scullc_devices = kmalloc(scullc_devs*sizeof (struct scull_dev), GFP_KERNEL);
 	if (!scullc_devices) {
 		result = -ENOMEM;
 		goto fail_malloc;
 	}
-	memset(scullc_devices, 0, scullc_devs*sizeof (struct scullc_dev));
+	memset(scullc_devices, 0, scullc_devs*sizeof (struct scull_dev));
 	for (i = 0; i < scullc_devs; i++) {
-		scullc_devices[i].quantum = scullc_quantum;
-		scullc_devices[i].qset = scullc_qset;
-		mutex_init (&scullc_devices[i].lock);
+		scull_dev_init(scullc_devices + i, &scullc_defaults);
+		scullc_devices[i].alloc = scull_alloc_pick("cache", 0);
+		scull_zip_start(scullc_devices + i);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
-	scullc_cache = kmem_cache_create("scullc", scullc_quantum,
-			0, SLAB_HWCACHE_ALIGN, NULL); /* no ctor/dtor */
-	if (!scullc_cache) {
-		scullc_cleanup();
-		return -ENOMEM;
-	}
 
 #ifdef SCULLC_USE_PROC /* only when available */
-	proc_create("scullcmem", 0, NULL, proc_ops_wrapper(&scullc_proc_ops,scullc_pops));
+	proc_create("scullcmem", 0, NULL, proc_ops_wrapper(&scullc_proc_ops, scullc_pops));
 #endif
 	return 0; /* succeed */
 
@@ -510,6 +296,7 @@ int scullc_init(void)
 
 void scullc_cleanup(void)
 {
+	struct scull_dev *dev;
 	int i;
 
 #ifdef SCULLC_USE_PROC
@@ -517,13 +304,14 @@ void scullc_cleanup(void)
 #endif
 
 	for (i = 0; i < scullc_devs; i++) {
-		cdev_del(&scullc_devices[i].cdev);
-		scullc_trim(scullc_devices + i);
+		dev = scullc_devices + i;
+		cdev_del(&dev->cdev);
+		scull_zip_stop(dev);
+		scull_trim(dev);
+		scull_alloc_release(dev);
 	}
+	scull_async_cleanup();
 	kfree(scullc_devices);
-
-	if (scullc_cache)
-		kmem_cache_destroy(scullc_cache);
 	unregister_chrdev_region(MKDEV (scullc_major, 0), scullc_devs);
 }
 
@@ -15,6 +15,10 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include "scull.h"		/* the device itself */
 
 /*
  * Macros to help debugging
@@ -41,29 +45,15 @@
 #define SCULLC_DEVS 4    /* scullc0 through scullc3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
- *
- * "scullc_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * The bare device is a scull device (see scull.h), whose quanta come
+ * from a slab cache: the "cache" method of the scull core.
  *
  * The array (quantum-set) is SCULLC_QSET long.
  */
 #define SCULLC_QUANTUM  4000 /* use a quantum size like scull */
 #define SCULLC_QSET     500
 
-struct scullc_dev {
-	void **data;
-	struct scullc_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int quantum;              /* the current allocation size */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct mutex lock;     /* Mutual exclusion */
-	struct cdev cdev;
-};
-
-extern struct scullc_dev *scullc_devices;
+extern struct scull_dev *scullc_devices;
 
 extern struct file_operations scullc_fops;
 
@@ -72,15 +62,9 @@ extern struct file_operations scullc_fops;
  */
 extern int scullc_major;     /* main.c */
 extern int scullc_devs;
-extern int scullc_order;
+extern int scullc_quantum;
 extern int scullc_qset;
 
-/*
- * Prototypes for shared functions
- */
-int scullc_trim(struct scullc_dev *dev);
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
-
 
 #ifdef SCULLC_DEBUG
 #  define SCULLC_USE_PROC
@@ -26,11 +26,13 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
-#include <linux/aio.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/huge_mm.h>	/* thp_get_unmapped_area() */
 #include "scull-shared/scull-async.h"
 #include "sculld.h"		/* local definitions */
 #include "access_ok_version.h"
+#include "proc_ops_version.h"
 
 int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
@@ -46,7 +48,15 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 struct sculld_dev *sculld_devices; /* allocated in sculld_init */
 
-int sculld_trim(struct sculld_dev *dev);
+/*
+ * Everything else is the scull core's: a trim gives a device these
+ * parameters, which the ioctls below change.
+ */
+static const struct scull_defaults sculld_defaults = {
+	.order =    &sculld_order,
+	.qset =     &sculld_qset,
+};
+
 void sculld_cleanup(void);
 
 
@@ -62,43 +72,24 @@ static struct ldd_driver sculld_driver = {
 };
 
 
-
 #ifdef SCULLD_USE_PROC /* don't waste space if unused */
 /*
  * The proc filesystem: function to read and entry
  */
 
-/* FIXME: Do we need this here??  It be ugly  */
 int sculld_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, order, qset;
-	int limit = m->size - 80; /* Don't print more than this */
-	struct sculld_dev *d;
+	struct scull_dev *d;
+	int i;
 
 	for(i = 0; i < sculld_devs; i++) {
-		d = &sculld_devices[i];
-		if (mutex_lock_interruptible (&d->mutex))
+		d = &sculld_devices[i].sdev;
+		if (down_read_killable(&d->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
-			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
-			if (m->count > limit)
-				goto out;
-			if (d->data && !d->next) /* dump only the last item - save space */
-				for (j = 0; j < qset; j++) {
-					if (d->data[j])
-						seq_printf(m,"    % 4i:%8p\n",j,d->data[j]);
-					if (m->count > limit)
-						goto out;
-				}
-		}
-	  out:
-		mutex_unlock (&sculld_devices[i].mutex);
-		if (m->count > limit)
-			break;
+				i, d->qset, get_order(d->quantum), d->size);
+		scull_alloc_show(m, d);
+		up_read(&d->sem);
 	}
 	return 0;
 }
@@ -119,159 +110,22 @@ static struct file_operations sculld_proc_ops = {
 #endif /* SCULLD_USE_PROC */
 
 /*
- * Open and close
+ * Open: get ready for asynchronous I/O, the rest is scull_open
  */
 
 int sculld_open (struct inode *inode, struct file *filp)
 {
-	struct sculld_dev *dev; /* device information */
-
-	/*  Find the device */
-	dev = container_of(inode->i_cdev, struct sculld_dev, cdev);
-
-    	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->mutex))
-			return -ERESTARTSYS;
-		sculld_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->mutex);
-	}
-
-	/* and use filp->private_data to point to the device data */
-	filp->private_data = dev;
+	int retval;
 
-	return 0;          /* success */
-}
-
-int sculld_release (struct inode *inode, struct file *filp)
-{
-	return 0;
+	retval = scull_async_open(filp);
+	if (retval)
+		return retval;
+	return scull_open(inode, filp);
 }
 
 /*
- * Follow the list 
- */
-struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct sculld_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct sculld_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
- */
-
-ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct sculld_dev *dev = filp->private_data; /* the first listitem */
-	struct sculld_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = sculld_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	mutex_unlock(&dev->mutex);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock(&dev->mutex);
-	return retval;
-}
-
-
-
-ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct sculld_dev *dev = filp->private_data;
-	struct sculld_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = sculld_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock(&dev->mutex);
-	return count;
-
-  nomem:
-	mutex_unlock(&dev->mutex);
-	return retval;
-}
-
-/*
- * The ioctl() implementation
+ * The ioctl() implementation: the order and qset are ours, the
+ * allocation commands of scull go to the core.
  */
 
 long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
@@ -279,6 +133,9 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 
 	int err = 0, ret = 0, tmp;
 
+	if (_IOC_TYPE(cmd) == SCULL_IOC_MAGIC)
+		return scull_alloc_ioctl(filp, cmd, arg);
+
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLD_IOC_MAGIC) return -ENOTTY;
 	if (_IOC_NR(cmd) > SCULLD_IOC_MAXNR) return -ENOTTY;
@@ -364,95 +221,31 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
-/*
- * The "extended" operations
- */
-
-loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
-{
-	struct sculld_dev *dev = filp->private_data;
-	long newpos;
-
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
- 
-/*
- * Mmap *is* available, but confined in a different file
- */
-extern int sculld_mmap(struct file *filp, struct vm_area_struct *vma);
-
 
 /*
- * The fops
+ * The fops: all of them but open and ioctl are the core's
  */
 
 struct file_operations sculld_fops = {
 	.owner =     THIS_MODULE,
-	.llseek =    sculld_llseek,
-	.read =	     sculld_read,
-	.write =     sculld_write,
+	.llseek =    scull_llseek,
+	.read_iter = scull_async_read_iter,
+	.write_iter = scull_async_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = sculld_ioctl,
-	.mmap =	     sculld_mmap,
+	.fallocate = scull_fallocate,
+	.mmap =	     scull_mmap,
+	.get_unmapped_area = thp_get_unmapped_area, /* PMD-aligned, if huge */
 	.open =	     sculld_open,
-	.release =   sculld_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.release =   scull_release,
 };
 
-int sculld_trim(struct sculld_dev *dev)
-{
-	struct sculld_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
 
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
-
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			/* This code frees a whole quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = sculld_qset;
-	dev->order = sculld_order;
-	dev->next = NULL;
-	return 0;
-}
-
-
-static void sculld_setup_cdev(struct sculld_dev *dev, int index)
+static void sculld_setup_cdev(struct scull_dev *dev, int index)
 {
 	int err, devno = MKDEV(sculld_major, index);
-    
+
 	cdev_init(&dev->cdev, &sculld_fops);
 	dev->cdev.owner = THIS_MODULE;
 	err = cdev_add (&dev->cdev, devno, 1);
@@ -465,7 +258,7 @@ static ssize_t sculld_show_dev(struct device *ddev, struct device_attribute *att
 {
 	struct sculld_dev *dev = dev_get_drvdata(ddev);
 
-	return print_dev_t(buf, dev->cdev.dev);
+	return print_dev_t(buf, dev->sdev.cdev.dev);
 }
 
 static DEVICE_ATTR(dev, S_IRUGO, sculld_show_dev, NULL);
@@ -481,6 +274,7 @@ static void sculld_register_dev(struct sculld_dev *dev, int index)
 }
 
 
+
 /*
  * Finally, the module stuff
  */
@@ -488,16 +282,17 @@ static void sculld_register_dev(struct sculld_dev *dev, int index)
 int sculld_init(void)
 {
 	int result, i;
-	dev_t dev = MKDEV(sculld_major, 0);
-	
+	dev_t devno = MKDEV(sculld_major, 0);
+	struct scull_dev *dev;
+
 	/*
 	 * Register your major, and accept a dynamic number.
 	 */
 	if (sculld_major)
-		result = register_chrdev_region(dev, sculld_devs, "sculld");
+		result = register_chrdev_region(devno, sculld_devs, "sculld");
 	else {
-		result = alloc_chrdev_region(&dev, 0, sculld_devs, "sculld");
-		sculld_major = MAJOR(dev);
+		result = alloc_chrdev_region(&devno, 0, sculld_devs, "sculld");
+		sculld_major = MAJOR(devno);
 	}
 	if (result < 0)
 		return result;
@@ -506,8 +301,8 @@ int sculld_init(void)
 	 * Register with the driver core.
 	 */
 	register_ldd_driver(&sculld_driver);
-	
-	/* 
+
+	/*
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
 	 */
@@ -518,21 +313,23 @@ int sculld_init(void)
 	}
 	memset(sculld_devices, 0, sculld_devs*sizeof (struct sculld_dev));
 	for (i = 0; i < sculld_devs; i++) {
-		sculld_devices[i].order = sculld_order;
-		sculld_devices[i].qset = sculld_qset;
-		mutex_init(&sculld_devices[i].mutex);
-		sculld_setup_cdev(sculld_devices + i, i);
+		dev = &sculld_devices[i].sdev;
+		scull_dev_init(dev, &sculld_defaults);
+		dev->alloc = scull_alloc_pick("pages", 0);
+		scull_zip_start(dev);
+		sculld_setup_cdev(dev, i);
 		sculld_register_dev(sculld_devices + i, i);
 	}
 
 
 #ifdef SCULLD_USE_PROC /* only when available */
-	proc_create("sculldmem", 0, NULL, &sculld_proc_ops);
+	proc_create("sculldmem", 0, NULL, proc_ops_wrapper(&sculld_proc_ops, sculld_pops));
 #endif
 	return 0; /* succeed */
 
   fail_malloc:
-	unregister_chrdev_region(dev, sculld_devs);
+	unregister_ldd_driver(&sculld_driver);
+	unregister_chrdev_region(devno, sculld_devs);
 	return result;
 }
 
@@ -540,6 +337,7 @@ int sculld_init(void)
 
 void sculld_cleanup(void)
 {
+	struct scull_dev *dev;
 	int i;
 
 #ifdef SCULLD_USE_PROC
@@ -547,10 +345,14 @@ void sculld_cleanup(void)
 #endif
 
 	for (i = 0; i < sculld_devs; i++) {
+		dev = &sculld_devices[i].sdev;
 		unregister_ldd_device(&sculld_devices[i].ldev);
-		cdev_del(&sculld_devices[i].cdev);
-		sculld_trim(sculld_devices + i);
+		cdev_del(&dev->cdev);
+		scull_zip_stop(dev);
+		scull_trim(dev);
+		scull_alloc_release(dev);
 	}
+	scull_async_cleanup();
 	kfree(sculld_devices);
 	unregister_ldd_driver(&sculld_driver);
 	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_devs);
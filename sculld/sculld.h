@@ -16,7 +16,11 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include "../include/lddbus.h"
+#include "scull.h"		/* the device itself */
 
 /*
  * Macros to help debugging
@@ -43,26 +47,18 @@
 #define SCULLD_DEVS 4    /* sculld0 through sculld3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * The bare device is a scull device (see scull.h), whose quanta are
+ * pages allocated by the "pages" method of the scull core; what
+ * sculld adds is its place in the device model, on the ldd bus.
  *
- * "sculld_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
- *
- * The array (quantum-set) is SCULLD_QSET long.
+ * A quantum is PAGE_SIZE << sculld_order bytes, and the array
+ * (quantum-set) is SCULLD_QSET long.
  */
 #define SCULLD_ORDER    0 /* one page at a time */
 #define SCULLD_QSET     500
 
 struct sculld_dev {
-	void **data;
-	struct sculld_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int order;                /* the current allocation order */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct mutex mutex;     /* Mutual exclusion */
-	struct cdev cdev;
+	struct scull_dev sdev;    /* the data, and the char device */
 	char devname[20];
 	struct ldd_device ldev;
 };
@@ -79,12 +75,6 @@ extern int sculld_devs;
 extern int sculld_order;
 extern int sculld_qset;
 
-/*
- * Prototypes for shared functions
- */
-int sculld_trim(struct sculld_dev *dev);
-struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
-
 
 #ifdef SCULLD_DEBUG
 #  define SCULLD_USE_PROC
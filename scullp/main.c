@@ -26,9 +26,9 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
-#include <linux/aio.h>
 #include <linux/uaccess.h>
-#include <linux/uio.h>	/* ivo_iter* */
+#include <linux/mm.h>
+#include <linux/huge_mm.h>	/* thp_get_unmapped_area() */
 #include "scullp.h"		/* local definitions */
 #include "scull-shared/scull-async.h"
 #include "access_ok_version.h"
@@ -38,22 +38,28 @@ int scullp_major =   SCULLP_MAJOR;
 int scullp_devs =    SCULLP_DEVS;	/* number of bare scullp devices */
 int scullp_qset =    SCULLP_QSET;
 int scullp_order =   SCULLP_ORDER;
+int scullp_huge =    0;		/* PMD-sized quanta, mapped as huge pages */
 
 module_param(scullp_major, int, 0);
 module_param(scullp_devs, int, 0);
 module_param(scullp_qset, int, 0);
 module_param(scullp_order, int, 0);
+module_param(scullp_huge, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct scullp_dev *scullp_devices; /* allocated in scullp_init */
-
-int scullp_trim(struct scullp_dev *dev);
-void scullp_cleanup(void);
-
-
+struct scull_dev *scullp_devices; /* allocated in scullp_init */
 
+/*
+ * Everything else is the scull core's: a trim gives a device these
+ * parameters, which the ioctls below change.
+ */
+static const struct scull_defaults scullp_defaults = {
+	.order =    &scullp_order,
+	.qset =     &scullp_qset,
+};
 
+void scullp_cleanup(void);
 
 
 #ifdef SCULLP_USE_PROC /* don't waste space if unused */
@@ -61,37 +67,19 @@ void scullp_cleanup(void);
  * The proc filesystem: function to read and entry
  */
 
-/* FIXME: Do we need this here??  It be ugly  */
 int scullp_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, order, qset;
-	int limit = m->size - 80; /* Don't print more than this */
-	struct scullp_dev *d;
+	struct scull_dev *d;
+	int i;
 
 	for(i = 0; i < scullp_devs; i++) {
 		d = &scullp_devices[i];
-		if (mutex_lock_interruptible (&d->mutex))
+		if (down_read_killable(&d->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
-			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
-			if (m->count > limit)
-				goto out;
-			if (d->data && !d->next) /* dump only the last item - save space */
-				for (j = 0; j < qset; j++) {
-					if (d->data[j])
-						seq_printf(m,"    % 4i:%8p\n",j,d->data[j]);
-					if (m->count > limit)
-						goto out;
-				}
-		}
-	  out:
-		mutex_unlock (&scullp_devices[i].mutex);
-		if (m->count > limit)
-			break;
+				i, d->qset, get_order(d->quantum), d->size);
+		scull_alloc_show(m, d);
+		up_read(&d->sem);
 	}
 	return 0;
 }
@@ -112,159 +100,22 @@ static struct file_operations scullp_proc_ops = {
 #endif /* SCULLP_USE_PROC */
 
 /*
- * Open and close
+ * Open: get ready for asynchronous I/O, the rest is scull_open
  */
 
 int scullp_open (struct inode *inode, struct file *filp)
 {
-	struct scullp_dev *dev; /* device information */
-
-	/*  Find the device */
-	dev = container_of(inode->i_cdev, struct scullp_dev, cdev);
-
-    	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->mutex))
-			return -ERESTARTSYS;
-		scullp_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->mutex);
-	}
-
-	/* and use filp->private_data to point to the device data */
-	filp->private_data = dev;
-
-	return 0;          /* success */
-}
-
-int scullp_release (struct inode *inode, struct file *filp)
-{
-	return 0;
-}
-
-/*
- * Follow the list 
- */
-struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullp_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
- */
-
-ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct scullp_dev *dev = filp->private_data; /* the first listitem */
-	struct scullp_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullp_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	mutex_unlock(&dev->mutex);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock(&dev->mutex);
-	return retval;
-}
+	int retval;
 
-
-
-ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct scullp_dev *dev = filp->private_data;
-	struct scullp_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullp_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock(&dev->mutex);
-	return count;
-
-  nomem:
-	mutex_unlock(&dev->mutex);
-	return retval;
+	retval = scull_async_open(filp);
+	if (retval)
+		return retval;
+	return scull_open(inode, filp);
 }
 
 /*
- * The ioctl() implementation
+ * The ioctl() implementation: the order and qset are ours, the
+ * allocation commands of scull go to the core.
  */
 
 long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
@@ -272,6 +123,9 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 
 	int err = 0, ret = 0, tmp;
 
+	if (_IOC_TYPE(cmd) == SCULL_IOC_MAGIC)
+		return scull_alloc_ioctl(filp, cmd, arg);
+
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLP_IOC_MAGIC) return -ENOTTY;
 	if (_IOC_NR(cmd) > SCULLP_IOC_MAXNR) return -ENOTTY;
@@ -357,95 +211,31 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
-/*
- * The "extended" operations
- */
-
-loff_t scullp_llseek (struct file *filp, loff_t off, int whence)
-{
-	struct scullp_dev *dev = filp->private_data;
-	long newpos;
 
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
- 
 /*
- * Mmap *is* available, but confined in a different file
- */
-extern int scullp_mmap(struct file *filp, struct vm_area_struct *vma);
-
-
-/*
- * The fops
+ * The fops: all of them but open and ioctl are the core's
  */
 
 struct file_operations scullp_fops = {
 	.owner =     THIS_MODULE,
-	.llseek =    scullp_llseek,
-	.read =	     scullp_read,
-	.write =     scullp_write,
+	.llseek =    scull_llseek,
+	.read_iter = scull_async_read_iter,
+	.write_iter = scull_async_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scullp_ioctl,
-	.mmap =	     scullp_mmap,
+	.fallocate = scull_fallocate,
+	.mmap =	     scull_mmap,
+	.get_unmapped_area = thp_get_unmapped_area, /* PMD-aligned, if huge */
 	.open =	     scullp_open,
-	.release =   scullp_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.release =   scull_release,
 };
 
-int scullp_trim(struct scullp_dev *dev)
-{
-	struct scullp_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
 
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
-
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			/* This code frees a whole quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = scullp_qset;
-	dev->order = scullp_order;
-	dev->next = NULL;
-	return 0;
-}
-
-
-static void scullp_setup_cdev(struct scullp_dev *dev, int index)
+static void scullp_setup_cdev(struct scull_dev *dev, int index)
 {
 	int err, devno = MKDEV(scullp_major, index);
-    
+
 	cdev_init(&dev->cdev, &scullp_fops);
 	dev->cdev.owner = THIS_MODULE;
 	dev->cdev.ops = &scullp_fops;
@@ -465,7 +255,7 @@ int scullp_init(void)
 {
 	int result, i;
 	dev_t dev = MKDEV(scullp_major, 0);
-	
+
 	/*
 	 * Register your major, and accept a dynamic number.
 	 */
@@ -478,21 +268,23 @@ int scullp_init(void)
 	if (result < 0)
 		return result;
 
-	
-	/* 
+
+	/*
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
 	 */
-	scullp_devices = kmalloc(scullp_devs*sizeof (struct scullp_dev), GFP_KERNEL);
+	scullp_devices = kmalloc(scullp_devs*sizeof (struct scull_dev), GFP_KERNEL);
 	if (!scullp_devices) {
 		result = -ENOMEM;
 		goto fail_malloc;
 	}
-	memset(scullp_devices, 0, scullp_devs*sizeof (struct scullp_dev));
+	memset(scullp_devices, 0, scullp_devs*sizeof (struct scull_dev));
+	if (scullp_huge)
+		scullp_order = SCULLP_HUGE_ORDER;
 	for (i = 0; i < scullp_devs; i++) {
-		scullp_devices[i].order = scullp_order;
-		scullp_devices[i].qset = scullp_qset;
-		mutex_init(&scullp_devices[i].mutex);
+		scull_dev_init(scullp_devices + i, &scullp_defaults);
+		scullp_devices[i].alloc = scull_alloc_pick("pages", 0);
+		scull_zip_start(scullp_devices + i);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
 
@@ -511,6 +303,7 @@ int scullp_init(void)
 
 void scullp_cleanup(void)
 {
+	struct scull_dev *dev;
 	int i;
 
 #ifdef SCULLP_USE_PROC
@@ -518,9 +311,13 @@ void scullp_cleanup(void)
 #endif
 
 	for (i = 0; i < scullp_devs; i++) {
-		cdev_del(&scullp_devices[i].cdev);
-		scullp_trim(scullp_devices + i);
+		dev = scullp_devices + i;
+		cdev_del(&dev->cdev);
+		scull_zip_stop(dev);
+		scull_trim(dev);
+		scull_alloc_release(dev);
 	}
+	scull_async_cleanup();
 	kfree(scullp_devices);
 	unregister_chrdev_region(MKDEV (scullp_major, 0), scullp_devs);
 }
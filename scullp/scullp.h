@@ -15,7 +15,10 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
-#include <linux/semaphore.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include "scull.h"		/* the device itself */
 
 /*
  * Macros to help debugging
@@ -42,29 +45,19 @@
 #define SCULLP_DEVS 4    /* scullp0 through scullp3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * The bare device is a scull device (see scull.h), whose quanta are
+ * pages allocated by the "pages" method of the scull core.
  *
- * "scullp_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
- *
- * The array (quantum-set) is SCULLP_QSET long.
+ * A quantum is PAGE_SIZE << scullp_order bytes, and the array
+ * (quantum-set) is SCULLP_QSET long.
  */
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
-struct scullp_dev {
-	void **data;
-	struct scullp_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int order;                /* the current allocation order */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct mutex mutex;     /* Mutual exclusion */
-	struct cdev cdev;
-};
+/* with "scullp_huge", a quantum is what a PMD maps: 2MB on x86 */
+#define SCULLP_HUGE_ORDER (PMD_SHIFT - PAGE_SHIFT)
 
-extern struct scullp_dev *scullp_devices;
+extern struct scull_dev *scullp_devices;
 
 extern struct file_operations scullp_fops;
 
@@ -75,12 +68,7 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
-
-/*
- * Prototypes for shared functions
- */
-int scullp_trim(struct scullp_dev *dev);
-struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
+extern int scullp_huge;
 
 
 #ifdef SCULLP_DEBUG
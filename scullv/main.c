@@ -26,11 +26,10 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
-#include <linux/aio.h>
 #include <linux/uaccess.h>
-#include <linux/vmalloc.h>
-#include "scull-shared/scull-async.h"
+#include <linux/mm.h>
 #include "scullv.h"		/* local definitions */
+#include "scull-shared/scull-async.h"
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
 
@@ -46,14 +45,18 @@ module_param(scullv_order, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct scullv_dev *scullv_devices; /* allocated in scullv_init */
-
-int scullv_trim(struct scullv_dev *dev);
-void scullv_cleanup(void);
-
-
+struct scull_dev *scullv_devices; /* allocated in scullv_init */
 
+/*
+ * Everything else is the scull core's: a trim gives a device these
+ * parameters, which the ioctls below change.
+ */
+static const struct scull_defaults scullv_defaults = {
+	.order =    &scullv_order,
+	.qset =     &scullv_qset,
+};
 
+void scullv_cleanup(void);
 
 
 #ifdef SCULLV_USE_PROC /* don't waste space if unused */
@@ -61,37 +64,19 @@ void scullv_cleanup(void);
  * The proc filesystem: function to read and entry
  */
 
-/* FIXME: Do we need this here??  It be ugly  */
 int scullv_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, order, qset;
-	int limit = m->size - 80; /* Don't print more than this */
-	struct scullv_dev *d;
+	struct scull_dev *d;
+	int i;
 
 	for(i = 0; i < scullv_devs; i++) {
 		d = &scullv_devices[i];
-		if (mutex_lock_interruptible (&d->mutex))
+		if (down_read_killable(&d->sem))
 			return -ERESTARTSYS;
-		qset = d->qset;  /* retrieve the features of each device */
-		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
-		for (; d; d = d->next) { /* scan the list */
-			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
-			if (m->count > limit)
-				goto out;
-			if (d->data && !d->next) /* dump only the last item - save space */
-				for (j = 0; j < qset; j++) {
-					if (d->data[j])
-						seq_printf(m,"    % 4i:%8p\n",j,d->data[j]);
-					if (m->count > limit)
-						goto out;
-				}
-		}
-	  out:
-		mutex_unlock (&scullv_devices[i].mutex);
-		if (m->count > limit)
-			break;
+				i, d->qset, get_order(d->quantum), d->size);
+		scull_alloc_show(m, d);
+		up_read(&d->sem);
 	}
 	return 0;
 }
@@ -112,158 +97,22 @@ static struct file_operations scullv_proc_ops = {
 #endif /* SCULLV_USE_PROC */
 
 /*
- * Open and close
+ * Open: get ready for asynchronous I/O, the rest is scull_open
  */
 
 int scullv_open (struct inode *inode, struct file *filp)
 {
-	struct scullv_dev *dev; /* device information */
-
-	/*  Find the device */
-	dev = container_of(inode->i_cdev, struct scullv_dev, cdev);
-
-    	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->mutex))
-			return -ERESTARTSYS;
-		scullv_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->mutex);
-	}
-
-	/* and use filp->private_data to point to the device data */
-	filp->private_data = dev;
-
-	return 0;          /* success */
-}
-
-int scullv_release (struct inode *inode, struct file *filp)
-{
-	return 0;
-}
-
-/*
- * Follow the list 
- */
-struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
-{
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullv_dev));
-		}
-		dev = dev->next;
-		continue;
-	}
-	return dev;
-}
-
-/*
- * Data management: read and write
- */
-
-ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct scullv_dev *dev = filp->private_data; /* the first listitem */
-	struct scullv_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-	if (*f_pos > dev->size) 
-		goto nothing;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-	/* find listitem, qset index, and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-    	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scullv_follow(dev, item);
-
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
-
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
-	}
-	mutex_unlock(&dev->mutex);
-
-	*f_pos += count;
-	return count;
-
-  nothing:
-	mutex_unlock(&dev->mutex);
-	return retval;
-}
-
-
+	int retval;
 
-ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-	struct scullv_dev *dev = filp->private_data;
-	struct scullv_dev *dptr;
-	int quantum = PAGE_SIZE << dev->order;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* our most likely error */
-
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
-
-	/* find listitem, qset index and offset in the quantum */
-	item = ((long) *f_pos) / itemsize;
-	rest = ((long) *f_pos) % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scullv_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using virtual addresses */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
-	}
-	*f_pos += count;
- 
-    	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
-	mutex_unlock(&dev->mutex);
-	return count;
-
-  nomem:
-    mutex_unlock(&dev->mutex);
-	return retval;
+	retval = scull_async_open(filp);
+	if (retval)
+		return retval;
+	return scull_open(inode, filp);
 }
 
 /*
- * The ioctl() implementation
+ * The ioctl() implementation: the order and qset are ours, the
+ * allocation commands of scull go to the core.
  */
 
 long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
@@ -271,6 +120,9 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 
 	int err = 0, ret = 0, tmp;
 
+	if (_IOC_TYPE(cmd) == SCULL_IOC_MAGIC)
+		return scull_alloc_ioctl(filp, cmd, arg);
+
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLV_IOC_MAGIC) return -ENOTTY;
 	if (_IOC_NR(cmd) > SCULLV_IOC_MAXNR) return -ENOTTY;
@@ -356,93 +208,30 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
-/*
- * The "extended" operations
- */
-
-loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
-{
-	struct scullv_dev *dev = filp->private_data;
-	long newpos;
-
-	switch(whence) {
-	case 0: /* SEEK_SET */
-		newpos = off;
-		break;
-
-	case 1: /* SEEK_CUR */
-		newpos = filp->f_pos + off;
-		break;
-
-	case 2: /* SEEK_END */
-		newpos = dev->size + off;
-		break;
-
-	default: /* can't happen */
-		return -EINVAL;
-	}
-	if (newpos<0) return -EINVAL;
-	filp->f_pos = newpos;
-	return newpos;
-}
-
-/*
- * Mmap *is* available, but confined in a different file
- */
-extern int scullv_mmap(struct file *filp, struct vm_area_struct *vma);
-
 
 /*
- * The fops
+ * The fops: all of them but open and ioctl are the core's
  */
 
 struct file_operations scullv_fops = {
 	.owner =     THIS_MODULE,
-	.llseek =    scullv_llseek,
-	.read =	     scullv_read,
-	.write =     scullv_write,
+	.llseek =    scull_llseek,
+	.read_iter = scull_async_read_iter,
+	.write_iter = scull_async_write_iter,
+	.splice_read = scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scullv_ioctl,
-	.mmap =	     scullv_mmap,
+	.fallocate = scull_fallocate,
+	.mmap =	     scull_mmap,
 	.open =	     scullv_open,
-	.release =   scullv_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.release =   scull_release,
 };
 
-int scullv_trim(struct scullv_dev *dev)
-{
-	struct scullv_dev *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	if (dev->vmas) /* don't trim: there are active mappings */
-		return -EBUSY;
-
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			/* Release the quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					vfree(dptr->data[i]);
-
-			kfree(dptr->data);
-			dptr->data=NULL;
-		}
-		next=dptr->next;
-		if (dptr != dev) kfree(dptr); /* all of them but the first */
-	}
-	dev->size = 0;
-	dev->qset = scullv_qset;
-	dev->order = scullv_order;
-	dev->next = NULL;
-	return 0;
-}
-
 
-static void scullv_setup_cdev(struct scullv_dev *dev, int index)
+static void scullv_setup_cdev(struct scull_dev *dev, int index)
 {
 	int err, devno = MKDEV(scullv_major, index);
-    
+
 	cdev_init(&dev->cdev, &scullv_fops);
 	dev->cdev.owner = THIS_MODULE;
 	err = cdev_add (&dev->cdev, devno, 1);
@@ -461,7 +250,7 @@ int scullv_init(void)
 {
 	int result, i;
 	dev_t dev = MKDEV(scullv_major, 0);
-	
+
 	/*
 	 * Register your major, and accept a dynamic number.
 	 */
@@ -474,27 +263,27 @@ int scullv_init(void)
 	if (result < 0)
 		return result;
 
-	
-	/* 
+
+	/*
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
 	 */
-	scullv_devices = kmalloc(scullv_devs*sizeof (struct scullv_dev), GFP_KERNEL);
+	scullv_devices = kmalloc(scullv_devs*sizeof (struct scull_dev), GFP_KERNEL);
 	if (!scullv_devices) {
 		result = -ENOMEM;
 		goto fail_malloc;
 	}
-	memset(scullv_devices, 0, scullv_devs*sizeof (struct scullv_dev));
+	memset(scullv_devices, 0, scullv_devs*sizeof (struct scull_dev));
 	for (i = 0; i < scullv_devs; i++) {
-		scullv_devices[i].order = scullv_order;
-		scullv_devices[i].qset = scullv_qset;
-		mutex_init(&scullv_devices[i].mutex);
+		scull_dev_init(scullv_devices + i, &scullv_defaults);
+		scullv_devices[i].alloc = scull_alloc_pick("vmalloc", 0);
+		scull_zip_start(scullv_devices + i);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
 
 #ifdef SCULLV_USE_PROC /* only when available */
-	proc_create("scullvmem", 0, NULL, proc_ops_wrapper(&scullv_proc_ops,scullv_pops));
+	proc_create("scullvmem", 0, NULL, proc_ops_wrapper(&scullv_proc_ops, scullv_pops));
 #endif
 	return 0; /* succeed */
 
@@ -507,6 +296,7 @@ int scullv_init(void)
 
 void scullv_cleanup(void)
 {
+	struct scull_dev *dev;
 	int i;
 
 #ifdef SCULLV_USE_PROC
@@ -514,9 +304,13 @@ void scullv_cleanup(void)
 #endif
 
 	for (i = 0; i < scullv_devs; i++) {
-		cdev_del(&scullv_devices[i].cdev);
-		scullv_trim(scullv_devices + i);
+		dev = scullv_devices + i;
+		cdev_del(&dev->cdev);
+		scull_zip_stop(dev);
+		scull_trim(dev);
+		scull_alloc_release(dev);
 	}
+	scull_async_cleanup();
 	kfree(scullv_devices);
 	unregister_chrdev_region(MKDEV (scullv_major, 0), scullv_devs);
 }
@@ -15,7 +15,10 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
-#include <linux/semaphore.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include "scull.h"		/* the device itself */
 
 /*
  * Macros to help debugging
@@ -42,29 +45,16 @@
 #define SCULLV_DEVS 4    /* scullv0 through scullv3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * The bare device is a scull device (see scull.h), whose quanta are
+ * allocated by the "vmalloc" method of the scull core.
  *
- * "scullv_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
- *
- * The array (quantum-set) is SCULLV_QSET long.
+ * A quantum is PAGE_SIZE << scullv_order bytes, and the array
+ * (quantum-set) is SCULLV_QSET long.
  */
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
 
-struct scullv_dev {
-	void **data;
-	struct scullv_dev *next;  /* next listitem */
-	int vmas;                 /* active mappings */
-	int order;                /* the current allocation order */
-	int qset;                 /* the current array size */
-	size_t size;              /* 32-bit will suffice */
-	struct mutex mutex;     /* Mutual exclusion */
-	struct cdev cdev;
-};
-
-extern struct scullv_dev *scullv_devices;
+extern struct scull_dev *scullv_devices;
 
 extern struct file_operations scullv_fops;
 
@@ -76,12 +66,6 @@ extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
 
-/*
- * Prototypes for shared functions
- */
-int scullv_trim(struct scullv_dev *dev);
-struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
-
 
 #ifdef SCULLV_DEBUG
 #  define SCULLV_USE_PROC